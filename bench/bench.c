@@ -0,0 +1,271 @@
+/*
+In process microbenchmark for the passfs callbacks.
+
+passfs.c is compiled into this program so the callbacks in userModeFS_oper can be
+called directly, without the kernel or the FUSE transport in between. Each
+callback is run in a tight loop by 1, 2, 4 ... threads against a scratch root made
+under $TMPDIR and the cost per call and the scaling over one thread are printed.
+This measures only what passfs itself adds (path building, monitor checks, stats
+compares, locking) plus the system call it passes the request on to.
+
+usage: passfs-bench [-t max threads] [-n calls per thread] [-o only this callback] [-s] [-m] [-u] [-c N] [-f N]
+	-s  enable the stats file as with -o stats
+	-m  monitor to /dev/null as with -m=/dev/null
+	-u  account CPU time per callback as with -o cputime
+	-c  keep N directories open as with -o dircache=N
+	-f  share up to N backing descriptors as with -o fdcache=N
+*/
+#define _GNU_SOURCE        /* for pthread barriers and mkdtemp */
+#include "../passfs.c"
+
+#include <pthread.h>
+#include <time.h>
+#include <ftw.h>
+
+#define BENCH_DEPTH 12        /* levels of directory above the test file */
+#define BENCH_IOSIZE 4096
+
+char *root;                           /* normally defined in opts.c */
+
+static char bench_dir[PATHLEN_MAX];     /* FUSE style path of the deepest directory */
+static char bench_file[PATHLEN_MAX];    /* FUSE style path of the shared test file */
+static long bench_calls = 100000;
+static pthread_barrier_t bench_barrier;
+
+struct bench_thread {
+	int id;
+	const struct bench_op *op;
+	struct fuse_file_info fi;
+	char path[PATHLEN_MAX+16];          /* per thread file for writes */
+	char buf[BENCH_IOSIZE];
+	int failed;
+};
+
+struct bench_op {
+	const char *name;
+	int (*setup)(struct bench_thread *t);
+	int (*call)(struct bench_thread *t);
+	void (*teardown)(struct bench_thread *t);
+};
+
+static int bench_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	(void)buf; (void)name; (void)stbuf; (void)off;
+	return 0;
+}
+
+static int call_getattr(struct bench_thread *t) {
+	struct stat st;
+	return userModeFS_oper.getattr(bench_file, &st);
+}
+
+static int call_access(struct bench_thread *t) {
+	return userModeFS_oper.access(bench_file, R_OK);
+}
+
+static int call_openrelease(struct bench_thread *t) {
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_RDONLY;
+	int res = userModeFS_oper.open(bench_file, &fi);
+	if (res) return res;
+	return userModeFS_oper.release(bench_file, &fi);
+}
+
+static int call_readdir(struct bench_thread *t) {
+	return userModeFS_oper.readdir(bench_dir, NULL, bench_filler, 0, &t->fi);
+}
+
+static int call_statfs(struct bench_thread *t) {
+	struct statvfs st;
+	return userModeFS_oper.statfs(bench_file, &st);
+}
+
+static int open_shared(struct bench_thread *t) {
+	memset(&t->fi, 0, sizeof(t->fi));
+	t->fi.flags = O_RDONLY;
+	return userModeFS_oper.open(bench_file, &t->fi);
+}
+
+static int open_private(struct bench_thread *t) {
+	snprintf(t->path, sizeof(t->path), "%s/w%d", bench_dir, t->id);
+	int res = userModeFS_oper.mknod(t->path, S_IFREG | 0644, 0);
+	if (res && res != -EEXIST) return res;
+	memset(&t->fi, 0, sizeof(t->fi));
+	t->fi.flags = O_RDWR;
+	return userModeFS_oper.open(t->path, &t->fi);
+}
+
+static void close_file(struct bench_thread *t) {
+	userModeFS_oper.release(t->path[0] ? t->path : bench_file, &t->fi);
+}
+
+static int call_read(struct bench_thread *t) {
+	int res = userModeFS_oper.read(bench_file, t->buf, BENCH_IOSIZE, 0, &t->fi);
+	return res < 0 ? res : 0;
+}
+
+static int call_write(struct bench_thread *t) {
+	int res = userModeFS_oper.write(t->path, t->buf, BENCH_IOSIZE, 0, &t->fi);
+	return res < 0 ? res : 0;
+}
+
+static const struct bench_op bench_ops[] = {
+	{ "getattr", NULL, call_getattr, NULL },
+	{ "access", NULL, call_access, NULL },
+	{ "open+release", NULL, call_openrelease, NULL },
+	{ "read 4k", open_shared, call_read, close_file },
+	{ "write 4k", open_private, call_write, close_file },
+	{ "readdir", NULL, call_readdir, NULL },
+	{ "statfs", NULL, call_statfs, NULL },
+	{ NULL, NULL, NULL, NULL }
+};
+
+static void *bench_run(void *arg) {
+	struct bench_thread *t = arg;
+	long i;
+
+	if (t->op->setup && t->op->setup(t)) t->failed = 1;
+	pthread_barrier_wait(&bench_barrier);
+	pthread_barrier_wait(&bench_barrier);   /* main thread takes the start time in between */
+	for (i = 0; i < bench_calls && !t->failed; i++) {
+		if (t->op->call(t)) t->failed = 1;
+	}
+	pthread_barrier_wait(&bench_barrier);
+	if (t->op->teardown && !t->failed) t->op->teardown(t);
+	return NULL;
+}
+
+static double bench_one(const struct bench_op *op, int nthreads) {/*
+run op in nthreads threads and return the wall clock nanoseconds per call per thread,
+returns a negative value if any call failed
+*/
+	pthread_t tid[nthreads];
+	struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+	struct timespec start, end;
+	int i, failed = 0;
+
+	pthread_barrier_init(&bench_barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		threads[i].id = i;
+		threads[i].op = op;
+		memset(threads[i].buf, 'x', BENCH_IOSIZE);
+		pthread_create(&tid[i], NULL, bench_run, &threads[i]);
+	}
+	pthread_barrier_wait(&bench_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_barrier_wait(&bench_barrier);
+	pthread_barrier_wait(&bench_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tid[i], NULL);
+		failed |= threads[i].failed;
+	}
+	pthread_barrier_destroy(&bench_barrier);
+	free(threads);
+
+	if (failed) return -1;
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / bench_calls;
+}
+
+static int bench_setup_root() {/*
+make a scratch root holding a BENCH_DEPTH deep directory chain with a test file at the bottom
+*/
+	const char *tmp = getenv("TMPDIR");
+	char p[PATHLEN_MAX];
+	int i, fd;
+
+	snprintf(p, PATHLEN_MAX, "%s/passfs-bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(p)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	root = strdup(p);
+
+	bench_dir[0] = '\0';
+	for (i = 0; i < BENCH_DEPTH; i++) {
+		snprintf(bench_dir + strlen(bench_dir), PATHLEN_MAX - strlen(bench_dir), "/d%d", i);
+		snprintf(p, PATHLEN_MAX, "%s%s", root, bench_dir);
+		if (mkdir(p, 0755) == -1) {
+			perror(p);
+			return 1;
+		}
+	}
+	snprintf(bench_file, PATHLEN_MAX, "%s/file", bench_dir);
+	snprintf(p, PATHLEN_MAX, "%s%s", root, bench_file);
+	fd = open(p, O_CREAT | O_WRONLY, 0644);
+	if (fd == -1) {
+		perror(p);
+		return 1;
+	}
+	char block[BENCH_IOSIZE];
+	memset(block, 'x', BENCH_IOSIZE);
+	for (i = 0; i < 16; i++) {
+		if (write(fd, block, BENCH_IOSIZE) != BENCH_IOSIZE) {
+			perror(p);
+			close(fd);
+			return 1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static int bench_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void)st; (void)flag; (void)ftw;
+	return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+	int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *only = NULL;
+	int c, n, res = 0;
+	const struct bench_op *op;
+
+	if (maxthreads < 1) maxthreads = 1;
+	debug_init(0);
+	stats_init();
+	qos_init();
+	dircache_init();
+	trace_init();
+	fdcache_init();
+	while ((c = getopt(argc, argv, "t:n:o:smuc:f:")) != -1) {
+		switch (c) {
+			case 't': maxthreads = atoi(optarg); break;
+			case 'n': bench_calls = atol(optarg); break;
+			case 'o': only = optarg; break;
+			case 's': stats_enabled = 1; break;
+			case 'm': monitorInit("/dev/null"); break;
+			case 'c': dircache_size = atoi(optarg); break;
+			case 'u': trace_cputime = 1; break;
+			case 'f': fdcache_max = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-t max threads] [-n calls per thread] [-o callback] [-s] [-m] [-u] [-c dircache size] [-f fdcache size]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (maxthreads < 1 || bench_calls < 1) return 1;
+	if (bench_setup_root()) return 1;
+
+	printf("root %s, depth %d, %ld calls per thread\n", root, BENCH_DEPTH, bench_calls);
+	printf("%-14s %8s %12s %12s %8s\n", "callback", "threads", "ns/op", "Mops/s", "scaling");
+	for (op = bench_ops; op->name; op++) {
+		if (only && strcmp(only, op->name) != 0) continue;
+		double base = 0;
+		for (n = 1; ; n *= 2) {
+			if (n > maxthreads) n = maxthreads;
+			double ns = bench_one(op, n);
+			if (ns < 0) {
+				printf("%-14s %8d %12s\n", op->name, n, "failed");
+				res = 1;
+				break;
+			}
+			if (n == 1) base = ns;
+			printf("%-14s %8d %12.1f %12.3f %8.2f\n", op->name, n, ns, n * 1e3 / ns, base * n / ns);
+			if (n == maxthreads) break;
+		}
+	}
+
+	nftw(root, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+	free(root);
+	return res;
+}
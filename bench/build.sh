@@ -0,0 +1,11 @@
+#!/bin/sh
+# builds the callback microbenchmark, passfs.c is included by bench.c so leave it and opts.c (which has main) out
+
+[ -z ${CC} ] && CC=gcc
+
+CFLAGS="${CFLAGS:--Wall -O2} $(pkg-config --cflags fuse)"
+LDFLAGS="${LDFLAGS} $(pkg-config --libs fuse) -lm -lz"
+[ -f /usr/include/sys/sdt.h ] && CPPFLAGS="${CPPFLAGS} -DHAVE_SYS_SDT_H"
+
+cd "$(dirname "$0")"
+${CC} ${CFLAGS} ${CPPFLAGS} -o passfs-bench bench.c $(ls ../*.c | grep -v -e /opts.c -e /passfs.c) ${LDFLAGS} "$@"
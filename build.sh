@@ -3,6 +3,7 @@
 [ -z ${CC} ] && CC=gcc
 
 CFLAGS="${CFLAGS:--Wall} $(pkg-config --cflags fuse)"
-LDFLAGS="${LDFLAGS} $(pkg-config --libs fuse)"
+LDFLAGS="${LDFLAGS} $(pkg-config --libs fuse) -lm -lz"
+[ -f /usr/include/sys/sdt.h ] && CPPFLAGS="${CPPFLAGS} -DHAVE_SYS_SDT_H"
 
 ${CC} ${CFLAGS} ${CPPFLAGS}  ${LDFLAGS} -o passfs *.c "$@"
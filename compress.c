@@ -0,0 +1,972 @@
+#define _GNU_SOURCE        /* for the *at() calls */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+
+#include "userModeFS.h"
+#include "fdcache.h"
+#include "sparse.h"
+#include "tier.h"
+#include "compress.h"
+/*
+Transparent compression. When the last handle that had a file open for writing
+is released the file is queued for a background thread, which compresses it in
+chunks of compress_chunk bytes that are each deflated on their own into a new
+backing file that replaces it, with the same owner, mode, extended attributes
+(ACLs included) and times. It is only replaced if that saves at least
+1/COMPRESS_MIN_SAVING of the size, and files with more than one link, on
+another filesystem than root or whose owner or attributes cannot be copied are
+left plain. The compressed file starts with a header giving the chunk size, the
+number of chunks and the logical size, followed by the offset of each chunk,
+so a read fetches and inflates only the chunks that cover it. The last chunk
+inflated is kept per open file for the next read.
+
+Which inodes are compressed is recorded in an index under COMPRESS_DIRNAME
+(with the size of the compressed file and the logical size), never taken from
+file content, so a file written to look like a compressed one is just a file.
+The index is held in memory, getattr finds the logical size there without any
+I/O. The header and offsets are checked against it and the file size before
+they are used; a marked file that fails the checks is not a compressed file, it
+loses its mark and is served as it is. At mount the tree under root is walked
+once and the marks of inodes not found there at the recorded size are dropped,
+so that a stale mark cannot fit an inode number that is reused later. Opening a compressed file for writing (or truncating it) first
+expands it back to a plain file, holding a lock on just that inode; it is
+compressed again once released.
+*/
+
+struct compress_hdr {
+	char magic[8];
+	uint32_t chunk;
+	uint32_t chunks;
+	uint64_t size;
+};   /* followed by chunks+1 uint64_t offsets, the last is the end of the file */
+
+/* index record, a zero size removes the inode */
+struct compress_rec {
+	uint32_t magic;
+	uint32_t sum;               /* FNV-1a of the record, taken with sum zero */
+	uint64_t ino;
+	uint64_t size;              /* of the compressed file */
+	uint64_t logical;
+};
+
+#define COMPRESS_REC_MAGIC 0x7a737070   /* "ppsz" */
+
+/* a compressed inode */
+struct compress_mark {
+	ino_t ino;
+	off_t size, logical;
+	char seen;                  /* found at mount */
+	struct compress_mark *next;
+};
+
+/* an open compressed file, by backing descriptor */
+struct compress_file {
+	int fd;
+	unsigned int refs;
+	uint32_t chunk, chunks;
+	uint64_t size;
+	uint64_t *offsets;          /* NULL if they could not be read, reads return EIO */
+	long cached;                /* chunk in buf, -1 if none */
+	char *buf;
+	struct compress_file *next;
+};
+
+/* inodes open for writing */
+struct compress_writer {
+	dev_t dev;
+	ino_t ino;
+	unsigned int writers;
+	struct compress_writer *next;
+};
+
+/* inodes being compressed or expanded */
+struct compress_busy {
+	ino_t ino;
+	struct compress_busy *next;
+};
+
+/* a file waiting to be compressed */
+struct compress_job {
+	char *path;
+	ino_t ino;
+	struct compress_job *next;
+};
+
+char compress_enabled;
+unsigned long compress_chunk;
+
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_idle = PTHREAD_COND_INITIALIZER;    /* an inode is no longer busy */
+static pthread_cond_t compress_work = PTHREAD_COND_INITIALIZER;    /* a job was queued */
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+static struct compress_mark *compress_marks[COMPRESS_BUCKETS];
+static struct compress_file *compress_files[COMPRESS_BUCKETS];
+static struct compress_writer *compress_writers[COMPRESS_BUCKETS];
+static struct compress_busy *compress_busy;
+static struct compress_job *compress_head, **compress_tail;
+static unsigned long compress_queued;
+static dev_t compress_dev;
+static int compress_index_fd;
+static off_t compress_index_end;
+static unsigned long compress_tmps;
+static unsigned long compress_done, compress_expanded, compress_skipped, compress_dropped;
+static unsigned long long compress_in, compress_out, compress_fetched, compress_returned;
+
+
+void compress_init() {
+	compress_enabled = 0;
+	compress_chunk = 65536;
+	compress_done = compress_expanded = compress_skipped = compress_dropped = 0;
+	compress_in = compress_out = compress_fetched = compress_returned = 0;
+	compress_busy = NULL;
+	compress_head = NULL;
+	compress_tail = &compress_head;
+	compress_queued = compress_tmps = 0;
+	compress_index_fd = -1;
+	compress_index_end = 0;
+	memset(compress_marks, 0, sizeof(compress_marks));
+	memset(compress_files, 0, sizeof(compress_files));
+	memset(compress_writers, 0, sizeof(compress_writers));
+}
+
+static unsigned int compress_hash(dev_t dev, ino_t ino) {
+	return (unsigned int)((ino * 2654435761u) ^ dev) % COMPRESS_BUCKETS;
+}
+
+static struct compress_mark **compress_mark_find(ino_t ino) {/*
+the link to the mark of ino, *result is NULL if there is none, called with the lock held
+*/
+	struct compress_mark **pm = &compress_marks[compress_hash(0, ino)];
+	while (*pm && (*pm)->ino != ino) pm = &(*pm)->next;
+	return pm;
+}
+
+static uint32_t compress_sum(const struct compress_rec *r) {
+	const unsigned char *s = (const unsigned char *)r;
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < sizeof(*r); i++) {
+		h = (h ^ (i >= offsetof(struct compress_rec, sum) && i < offsetof(struct compress_rec, sum) + 4 ? 0 : s[i])) * 16777619u;
+	}
+	return h;
+}
+
+static int compress_pwrite(int fd, const void *buf, size_t len, off_t off) {/*
+write all of buf at off, returns 0 or -errno
+*/
+	const char *b = buf;
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, b, len, off);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return n == -1 ? -errno : -EIO;
+		b += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int compress_log(ino_t ino, off_t size, off_t logical) {/*
+append a record to the index and apply it, called with the lock held
+*/
+	struct compress_mark **pm = compress_mark_find(ino), *m = *pm;
+	struct compress_rec r;
+	int res;
+
+	memset(&r, 0, sizeof(r));
+	r.magic = COMPRESS_REC_MAGIC;
+	r.ino = ino;
+	r.size = size;
+	r.logical = logical;
+	r.sum = compress_sum(&r);
+	if (size && !m && !(m = calloc(1, sizeof(struct compress_mark)))) return -ENOMEM;
+	if ((res = compress_pwrite(compress_index_fd, &r, sizeof(r), compress_index_end))) {
+		if (ftruncate(compress_index_fd, compress_index_end) == -1) perror("compress index");
+		if (!*pm) free(m);
+		return res;
+	}
+	compress_index_end += sizeof(r);
+	if (!size) {
+		if (m) {
+			*pm = m->next;
+			free(m);
+		}
+		return 0;
+	}
+	if (!*pm) {
+		m->next = *pm;
+		*pm = m;
+	}
+	m->ino = ino;
+	m->size = size;
+	m->logical = logical;
+	return 0;
+}
+
+static int compress_mark(ino_t ino, off_t size, off_t logical) {/*
+record ino as compressed, durably as the file is about to depend on it
+*/
+	pthread_mutex_lock(&compress_lock);
+	int res = compress_log(ino, size, logical);
+	pthread_mutex_unlock(&compress_lock);
+	if (!res && fdatasync(compress_index_fd) == -1) res = -errno;
+	return res;
+}
+
+static void compress_unmark(ino_t ino) {
+	pthread_mutex_lock(&compress_lock);
+	if (*compress_mark_find(ino) && compress_log(ino, 0, 0)) {
+		/* not recorded, forget it until the next mount all the same */
+		struct compress_mark **pm = compress_mark_find(ino), *m = *pm;
+		*pm = m->next;
+		free(m);
+	}
+	pthread_mutex_unlock(&compress_lock);
+}
+
+static int compress_logical(const struct stat *st, off_t *logical) {/*
+is st a compressed file, with its logical size in logical
+*/
+	struct compress_mark *m;
+	int res = 0;
+
+	if (!compress_enabled || !S_ISREG(st->st_mode) || st->st_dev != compress_dev) return 0;
+	pthread_mutex_lock(&compress_lock);
+	m = *compress_mark_find(st->st_ino);
+	if (m && m->size == st->st_size) {
+		*logical = m->logical;
+		res = 1;
+	}
+	pthread_mutex_unlock(&compress_lock);
+	return res;
+}
+
+int compress_marked(const struct stat *st) {
+	off_t logical;
+	return compress_logical(st, &logical);
+}
+
+int compress_reserved(const char *path) {/*
+is path the compression directory or inside it
+*/
+	size_t len = strlen(COMPRESS_DIRNAME);
+	return strncmp(path, COMPRESS_DIRNAME, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static int compress_seen(const char *path, const struct stat *st, int type, struct FTW *ftw) {/*
+nftw callback of compress_load, notes the marks that still fit a file
+*/
+	struct compress_mark *m;
+
+	(void)path;
+	(void)ftw;
+	if (type == FTW_F && S_ISREG(st->st_mode) && (m = *compress_mark_find(st->st_ino)) && m->size == st->st_size) m->seen = 1;
+	return 0;
+}
+
+int compress_load() {/*
+read the index of compressed inodes and write it back without the records that no longer count
+or whose files are gone, returns 0 or -1
+*/
+	char p[PATHLEN_MAX], q[PATHLEN_MAX];
+	struct compress_rec r;
+	struct compress_mark *m;
+	struct stat st;
+	struct dirent *de;
+	DIR *dp;
+	FILE *f;
+	unsigned long bad = 0, stale = 0;
+	int i;
+
+	if (stat(root, &st) == -1) {
+		perror(root);
+		return -1;
+	}
+	compress_dev = st.st_dev;
+	snprintf(p, PATHLEN_MAX, "%s" COMPRESS_DIRNAME, root);
+	if (mkdir(p, 0700) == -1 && errno != EEXIST) {
+		perror(p);
+		return -1;
+	}
+	/* temporary files left by a crash */
+	if ((dp = opendir(p))) {
+		while ((de = readdir(dp)) != NULL) {
+			size_t len = strlen(de->d_name);
+			if (len > 4 && strcmp(de->d_name + len - 4, ".tmp") == 0) unlinkat(dirfd(dp), de->d_name, 0);
+		}
+		closedir(dp);
+	}
+
+	snprintf(p, PATHLEN_MAX, "%s" COMPRESS_DIRNAME "/index", root);
+	if ((f = fopen(p, "r"))) {
+		while (fread(&r, sizeof(r), 1, f) == 1) {
+			struct compress_mark **pm = compress_mark_find(r.ino);
+			if (r.magic != COMPRESS_REC_MAGIC || r.sum != compress_sum(&r)) {
+				bad++;
+				continue;
+			}
+			if ((m = *pm) && !r.size) {
+				*pm = m->next;
+				free(m);
+			}
+			else if (r.size && (m || (m = calloc(1, sizeof(struct compress_mark))))) {
+				if (!*pm) {
+					m->next = *pm;
+					*pm = m;
+				}
+				m->ino = r.ino;
+				m->size = r.size;
+				m->logical = r.logical;
+			}
+		}
+		fclose(f);
+		if (bad) fprintf(stderr, "%s: skipped %lu damaged records\n", p, bad);
+	}
+	else if (errno != ENOENT) {
+		perror(p);
+		return -1;
+	}
+	/* marks left for inodes that are gone or were changed behind our back */
+	for (i = 0; i < COMPRESS_BUCKETS && !compress_marks[i]; i++);
+	if (i < COMPRESS_BUCKETS && nftw(root, compress_seen, 64, FTW_PHYS | FTW_MOUNT) == -1) {
+		perror(root);
+		return -1;
+	}
+	for (i = 0; i < COMPRESS_BUCKETS; i++) {
+		struct compress_mark **pm = &compress_marks[i];
+		while ((m = *pm)) {
+			if (m->seen) {
+				pm = &m->next;
+				continue;
+			}
+			*pm = m->next;
+			free(m);
+			stale++;
+		}
+	}
+	if (stale) fprintf(stderr, "%s: dropped %lu marks of files no longer there\n", p, stale);
+
+	snprintf(q, PATHLEN_MAX, "%s" COMPRESS_DIRNAME "/index.new", root);
+	compress_index_fd = open(q, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (compress_index_fd == -1) {
+		perror(q);
+		return -1;
+	}
+	for (i = 0; i < COMPRESS_BUCKETS; i++) {
+		for (m = compress_marks[i]; m; m = m->next) {
+			memset(&r, 0, sizeof(r));
+			r.magic = COMPRESS_REC_MAGIC;
+			r.ino = m->ino;
+			r.size = m->size;
+			r.logical = m->logical;
+			r.sum = compress_sum(&r);
+			if (compress_pwrite(compress_index_fd, &r, sizeof(r), compress_index_end)) break;
+			compress_index_end += sizeof(r);
+		}
+		if (m) break;
+	}
+	if (i < COMPRESS_BUCKETS || fsync(compress_index_fd) == -1 || rename(q, p) == -1) {
+		perror(q);
+		return -1;
+	}
+	return 0;
+}
+
+static void compress_claim(ino_t ino) {/*
+wait until nothing else compresses or expands ino and take it
+*/
+	struct compress_busy *b, *me = malloc(sizeof(struct compress_busy));
+
+	pthread_mutex_lock(&compress_lock);
+	for (;;) {
+		for (b = compress_busy; b && b->ino != ino; b = b->next);
+		if (!b) break;
+		pthread_cond_wait(&compress_idle, &compress_lock);
+	}
+	if (me) {
+		me->ino = ino;
+		me->next = compress_busy;
+		compress_busy = me;
+	}
+	/* out of memory, go ahead unclaimed: the checks before replacing still hold */
+	pthread_mutex_unlock(&compress_lock);
+}
+
+static void compress_unclaim(ino_t ino) {
+	struct compress_busy **pb, *b;
+
+	pthread_mutex_lock(&compress_lock);
+	for (pb = &compress_busy; (b = *pb) && b->ino != ino; pb = &b->next);
+	if (b) {
+		*pb = b->next;
+		free(b);
+	}
+	pthread_cond_broadcast(&compress_idle);
+	pthread_mutex_unlock(&compress_lock);
+}
+
+void compress_stat(struct stat *st) {/*
+replace the size of a compressed file with its logical size
+*/
+	off_t logical;
+	if (compress_logical(st, &logical)) st->st_size = logical;
+}
+
+static uint64_t *compress_index(int fd, struct compress_hdr *h, const struct stat *st, off_t logical) {/*
+read and check the header and chunk offsets of a compressed file, NULL with errno set to EINVAL
+if they do not fit the file, to something else if they could not be read
+*/
+	struct compress_hdr hdr;
+	uint64_t *offsets;
+	size_t len;
+	uint32_t i;
+
+	ssize_t n;
+
+	if ((n = pread(fd, &hdr, sizeof(hdr), 0)) == -1) return NULL;
+	errno = EINVAL;
+	if (n != sizeof(hdr) || memcmp(hdr.magic, COMPRESS_MAGIC, 8) != 0 ||
+	    hdr.chunk < 4096 || hdr.chunk > (1 << 24) || hdr.size != (uint64_t)logical ||
+	    hdr.chunks != (hdr.size + hdr.chunk - 1) / hdr.chunk || (uint64_t)hdr.chunks >= (uint64_t)st->st_size / sizeof(uint64_t)) return NULL;
+	len = ((size_t)hdr.chunks + 1) * sizeof(uint64_t);
+	if (!(offsets = malloc(len))) return NULL;
+	if ((n = pread(fd, offsets, len, sizeof(hdr))) == -1) {
+		free(offsets);
+		return NULL;
+	}
+	errno = EINVAL;
+	if (n != (ssize_t)len || offsets[0] != sizeof(hdr) + len || offsets[hdr.chunks] != (uint64_t)st->st_size) {
+		free(offsets);
+		return NULL;
+	}
+	for (i = 0; i < hdr.chunks; i++) {
+		if (offsets[i + 1] <= offsets[i] || offsets[i + 1] - offsets[i] > compressBound(hdr.chunk)) {
+			free(offsets);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	*h = hdr;
+	return offsets;
+}
+
+static int compress_tmp(char *tmp) {/*
+create a temporary file in the compression directory, returns its descriptor or -errno
+*/
+	int fd;
+
+	snprintf(tmp, PATHLEN_MAX, "%s" COMPRESS_DIRNAME "/%lu.tmp", root, __sync_fetch_and_add(&compress_tmps, 1));
+	fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0600);
+	return fd == -1 ? -errno : fd;
+}
+
+static int compress_xattrs(int src, int dst) {/*
+copy the extended attributes, ACLs included, of src to dst
+*/
+	char *names = NULL, *value = NULL, *name;
+	ssize_t len, vlen;
+	int res = 0;
+
+	len = flistxattr(src, NULL, 0);
+	if (len <= 0) return len == -1 && errno != ENOTSUP ? -errno : 0;
+	if (!(names = malloc(len)) || (len = flistxattr(src, names, len)) == -1) res = names ? -errno : -ENOMEM;
+	for (name = names; !res && name < names + len; name += strlen(name) + 1) {
+		vlen = fgetxattr(src, name, NULL, 0);
+		if (vlen == -1 || !(value = realloc(value, vlen + 1)) || (vlen = fgetxattr(src, name, value, vlen)) == -1 ||
+		    fsetxattr(dst, name, value, vlen, 0) == -1) res = value ? -errno : -ENOMEM;
+	}
+	free(names);
+	free(value);
+	return res;
+}
+
+static int compress_replace(const char *path, const char *tmp, int out, const struct stat *st, int src, off_t logical) {/*
+give the new file at tmp the owner and attributes of the one at path and put it in its place,
+provided nobody has it open for writing and it is still there unchanged. logical is the size
+recorded for a compressed out, -1 when out is a plain file replacing a compressed one
+*/
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	struct compress_writer *w;
+	struct stat now, o;
+	char p[PATHLEN_MAX];
+	int res = 0;
+
+	/* an owner or attribute that cannot be copied leaves the file as it is */
+	if (fchown(out, st->st_uid, st->st_gid) == -1) return -errno;
+	if ((res = compress_xattrs(src, out))) return res;
+	if (fchmod(out, st->st_mode & 07777) == -1 || futimens(out, times) == -1 || fdatasync(out) == -1 || fstat(out, &o) == -1) return -errno;
+	if (fstat(src, &now) == -1) return -errno;
+	if (now.st_size != st->st_size || now.st_mtim.tv_sec != st->st_mtim.tv_sec || now.st_mtim.tv_nsec != st->st_mtim.tv_nsec ||
+	    now.st_ctim.tv_sec != st->st_ctim.tv_sec || now.st_ctim.tv_nsec != st->st_ctim.tv_nsec) return -EAGAIN;
+	/* the mark goes first, a crash must not leave the compressed data looking like a plain file */
+	if (logical != -1 && (res = compress_mark(o.st_ino, o.st_size, logical))) return res;
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	pthread_mutex_lock(&compress_lock);
+	for (w = compress_writers[compress_hash(st->st_dev, st->st_ino)]; w && (w->dev != st->st_dev || w->ino != st->st_ino); w = w->next);
+	if (w) res = -EBUSY;
+	else if (lstat(p, &now) == -1 || now.st_dev != st->st_dev || now.st_ino != st->st_ino || now.st_nlink != 1) res = -EAGAIN;
+	else if (rename(tmp, p) == -1) res = -errno;
+	pthread_mutex_unlock(&compress_lock);
+	if (res == 0) {
+		tier_invalidate(path, 0);
+		compress_unmark(st->st_ino);
+	}
+	else if (logical != -1) compress_unmark(o.st_ino);
+	return res;
+}
+
+static int compress_path(const char *path, ino_t ino) {/*
+compress the file at path if it is still the inode that was written, called holding the claim on ino
+*/
+	char p[PATHLEN_MAX], tmp[PATHLEN_MAX];
+	struct compress_hdr h;
+	struct stat st;
+	uint64_t *offsets = NULL;
+	char *in = NULL, *out = NULL;
+	uint64_t pos;
+	uint32_t i;
+	int src, dst = -1, res = 0;
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	src = open(p, O_RDONLY | O_NOFOLLOW);
+	if (src == -1) return -errno;
+	if (fstat(src, &st) == -1 || st.st_dev != compress_dev || st.st_ino != ino || !S_ISREG(st.st_mode) ||
+	    st.st_nlink != 1 || st.st_size < COMPRESS_MIN_SIZE || compress_marked(&st)) goto out;
+
+	memcpy(h.magic, COMPRESS_MAGIC, 8);
+	h.chunk = compress_chunk;
+	h.size = st.st_size;
+	h.chunks = (h.size + h.chunk - 1) / h.chunk;
+	offsets = malloc(((size_t)h.chunks + 1) * sizeof(uint64_t));
+	in = malloc(h.chunk);
+	out = malloc(compressBound(h.chunk));
+	if (!offsets || !in || !out) {
+		res = -ENOMEM;
+		goto out;
+	}
+	if ((dst = compress_tmp(tmp)) < 0) {
+		res = dst;
+		goto out;
+	}
+
+	pos = sizeof(h) + ((uint64_t)h.chunks + 1) * sizeof(uint64_t);
+	for (i = 0; i < h.chunks; i++) {
+		size_t len = h.size - (uint64_t)i * h.chunk < h.chunk ? h.size - (uint64_t)i * h.chunk : h.chunk;
+		uLongf zlen = compressBound(h.chunk);
+		if (pread(src, in, len, (off_t)i * h.chunk) != (ssize_t)len) res = -EAGAIN;
+		else if (compress2((Bytef *)out, &zlen, (Bytef *)in, len, Z_DEFAULT_COMPRESSION) != Z_OK) res = -EIO;
+		else res = compress_pwrite(dst, out, zlen, pos);
+		if (res) break;
+		offsets[i] = pos;
+		pos += zlen;
+		if (pos > h.size - h.size / COMPRESS_MIN_SAVING) break;   /* not worth it */
+	}
+	offsets[h.chunks] = pos;
+	if (!res && pos > h.size - h.size / COMPRESS_MIN_SAVING) {
+		__sync_fetch_and_add(&compress_skipped, 1);
+		res = -1;
+	}
+	if (!res) res = compress_pwrite(dst, &h, sizeof(h), 0);
+	if (!res) res = compress_pwrite(dst, offsets, ((size_t)h.chunks + 1) * sizeof(uint64_t), sizeof(h));
+	if (!res) res = compress_replace(path, tmp, dst, &st, src, h.size);
+	if (!res) {
+		__sync_fetch_and_add(&compress_done, 1);
+		__sync_fetch_and_add(&compress_in, h.size);
+		__sync_fetch_and_add(&compress_out, pos);
+	}
+	else unlink(tmp);
+out:
+	if (dst >= 0) close(dst);
+	close(src);
+	free(offsets);
+	free(in);
+	free(out);
+	return res;
+}
+
+static int compress_expand(const char *path, ino_t ino) {/*
+turn the file at path back into a plain file if it is compressed inode ino, called holding the claim on ino
+*/
+	char p[PATHLEN_MAX], tmp[PATHLEN_MAX];
+	struct compress_hdr h;
+	struct stat st;
+	uint64_t *offsets = NULL;
+	char *in = NULL, *out = NULL;
+	off_t logical;
+	uint32_t i;
+	int src, dst = -1, res = 0;
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	src = open(p, O_RDONLY | O_NOFOLLOW);
+	if (src == -1) return errno == ENOENT || errno == ELOOP ? 0 : -errno;
+	if (fstat(src, &st) == -1 || st.st_ino != ino || !compress_logical(&st, &logical)) goto out;
+
+	if (!(offsets = compress_index(src, &h, &st, logical))) {
+		/* not a compressed file after all, it is plain as it is */
+		if (errno == EINVAL) compress_unmark(ino);
+		else res = -errno;
+		goto out;
+	}
+	in = malloc(compressBound(h.chunk));
+	out = malloc(h.chunk);
+	if (!in || !out) {
+		res = -ENOMEM;
+		goto out;
+	}
+	if ((dst = compress_tmp(tmp)) < 0) {
+		res = dst;
+		goto out;
+	}
+	for (i = 0; i < h.chunks && !res; i++) {
+		size_t zlen = offsets[i + 1] - offsets[i];
+		uLongf len = h.chunk;
+		if (pread(src, in, zlen, offsets[i]) != (ssize_t)zlen || uncompress((Bytef *)out, &len, (Bytef *)in, zlen) != Z_OK) res = -EIO;
+		else res = compress_pwrite(dst, out, len, (off_t)i * h.chunk);
+	}
+	if (!res) res = compress_replace(path, tmp, dst, &st, src, -1);
+	if (!res) __sync_fetch_and_add(&compress_expanded, 1);
+	else unlink(tmp);
+out:
+	if (dst >= 0) close(dst);
+	close(src);
+	free(offsets);
+	free(in);
+	free(out);
+	return res;
+}
+
+int compress_prepare(const char *path, int flags) {/*
+before path is opened with flags (or truncated), expand it if it is compressed and will be written
+*/
+	char p[PATHLEN_MAX];
+	struct compress_mark *m;
+	struct stat st;
+	off_t size;
+	int res;
+
+	if ((flags & 3) == O_RDONLY || (flags & O_TRUNC)) return 0;
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	if (lstat(p, &st) == -1 || !S_ISREG(st.st_mode) || st.st_dev != compress_dev) return 0;
+	pthread_mutex_lock(&compress_lock);
+	m = *compress_mark_find(st.st_ino);
+	size = m ? m->size : -1;
+	pthread_mutex_unlock(&compress_lock);
+	if (size == -1) return 0;
+	if (size != st.st_size) {
+		/* truncated since it was compressed, it is plain now */
+		compress_unmark(st.st_ino);
+		return 0;
+	}
+	compress_claim(st.st_ino);
+	res = compress_expand(path, st.st_ino);
+	compress_unclaim(st.st_ino);
+	return res;
+}
+
+static void compress_attach(int fd) {/*
+note a read only descriptor, loading the chunk index if the file is compressed
+*/
+	struct compress_file *f;
+	struct compress_hdr h;
+	struct stat st;
+	off_t logical;
+
+	if (fstat(fd, &st) == -1 || !compress_logical(&st, &logical)) return;
+	pthread_mutex_lock(&compress_lock);
+	for (f = compress_files[fd % COMPRESS_BUCKETS]; f && f->fd != fd; f = f->next);
+	if (f) f->refs++;
+	pthread_mutex_unlock(&compress_lock);
+	if (f || !(f = calloc(1, sizeof(struct compress_file)))) return;
+
+	f->fd = fd;
+	f->refs = 1;
+	f->cached = -1;
+	if (!(f->offsets = compress_index(fd, &h, &st, logical)) && errno == EINVAL) {
+		/* not a compressed file after all, read it as it is */
+		free(f);
+		compress_unmark(st.st_ino);
+		return;
+	}
+	if (f->offsets) {
+		f->chunk = h.chunk;
+		f->chunks = h.chunks;
+		f->size = h.size;
+		if (!(f->buf = malloc(h.chunk))) {
+			free(f->offsets);
+			free(f);
+			return;
+		}
+	}
+	pthread_mutex_lock(&compress_lock);
+	f->next = compress_files[fd % COMPRESS_BUCKETS];
+	compress_files[fd % COMPRESS_BUCKETS] = f;
+	pthread_mutex_unlock(&compress_lock);
+}
+
+static int compress_writer(const struct stat *st, int opened) {/*
+count a writer of st in (1) or out (0), returns 1 when the last one went out
+*/
+	struct compress_writer **pw, *w;
+	int last = 0;
+
+	pthread_mutex_lock(&compress_lock);
+	for (pw = &compress_writers[compress_hash(st->st_dev, st->st_ino)]; (w = *pw) && (w->dev != st->st_dev || w->ino != st->st_ino); pw = &w->next);
+	if (opened) {
+		if (!w && (w = calloc(1, sizeof(struct compress_writer)))) {
+			w->dev = st->st_dev;
+			w->ino = st->st_ino;
+			w->next = *pw;
+			*pw = w;
+		}
+		if (w) w->writers++;
+	}
+	else if (w && --w->writers == 0) {
+		*pw = w->next;
+		free(w);
+		last = 1;
+	}
+	pthread_mutex_unlock(&compress_lock);
+	return last;
+}
+
+int compress_opened(const char *path, int fd, int flags) {/*
+called with each descriptor opened for path, returns the descriptor to use or -1 with errno set
+*/
+	char p[PATHLEN_MAX];
+	struct compress_mark *m;
+	struct stat st, now;
+	off_t size;
+	int res;
+
+	if ((flags & 3) == O_RDONLY) {
+		compress_attach(fd);
+		return fd;
+	}
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	for (;;) {
+		if (fstat(fd, &st) == -1) return fd;
+		/* once counted no compression replaces this inode */
+		compress_writer(&st, 1);
+		if (lstat(p, &now) == -1 || (now.st_dev == st.st_dev && now.st_ino == st.st_ino)) {
+			pthread_mutex_lock(&compress_lock);
+			m = st.st_dev == compress_dev ? *compress_mark_find(st.st_ino) : NULL;
+			size = m ? m->size : -1;
+			pthread_mutex_unlock(&compress_lock);
+			/* a compressed file truncated by the open is plain now */
+			if (size != st.st_size) {
+				if (size != -1) compress_unmark(st.st_ino);
+				return fd;
+			}
+		}
+		/* compressed since compress_prepare looked, or replaced between the open and now: expand and open again */
+		compress_writer(&st, 0);
+		fdcache_release(fd);
+		if ((res = compress_prepare(path, flags))) {
+			errno = -res;
+			return -1;
+		}
+		fd = open(p, flags & ~(O_CREAT | O_EXCL));
+		if (fd == -1) return -1;
+	}
+}
+
+int compress_hold(const char *path, struct stat *st) {/*
+expand the file at path if it is compressed and keep it from being compressed until
+compress_unhold, for giving it another link. returns 0 with st filled in or -errno
+*/
+	char p[PATHLEN_MAX];
+	struct stat now;
+	int res;
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	for (;;) {
+		if (lstat(p, st) == -1) return -errno;
+		if (!S_ISREG(st->st_mode)) return 0;
+		compress_writer(st, 1);
+		if (lstat(p, &now) == 0 && now.st_dev == st->st_dev && now.st_ino == st->st_ino && !compress_marked(&now)) return 0;
+		compress_writer(st, 0);
+		if ((res = compress_prepare(path, O_WRONLY))) return res;
+	}
+}
+
+void compress_unhold(const struct stat *st) {
+	if (S_ISREG(st->st_mode)) compress_writer(st, 0);
+}
+
+ssize_t compress_pread(int fd, char *buf, size_t size, off_t offset) {/*
+pread that inflates the chunks of compressed files
+*/
+	struct compress_file *f;
+	char *z = NULL, *chunk = NULL;
+	uint64_t zbase = 0;
+	size_t done = 0;
+	long first, last, i;
+
+	pthread_mutex_lock(&compress_lock);
+	for (f = compress_files[fd % COMPRESS_BUCKETS]; f && f->fd != fd; f = f->next);
+	pthread_mutex_unlock(&compress_lock);
+	if (!f) return sparse_enabled ? sparse_pread(fd, buf, size, offset) : pread(fd, buf, size, offset);
+	if (!f->offsets) {
+		errno = EIO;
+		return -1;
+	}
+
+	if ((uint64_t)offset >= f->size || !size) return 0;
+	if (size > f->size - offset) size = f->size - offset;
+	first = offset / f->chunk;
+	last = (offset + size - 1) / f->chunk;
+	for (i = first; i <= last; i++) {
+		uint64_t start = (uint64_t)i * f->chunk;
+		size_t len = f->size - start < f->chunk ? f->size - start : f->chunk;
+		size_t lo = offset > (off_t)start ? offset - start : 0;
+		size_t hi = offset + size < start + len ? offset + size - start : len;
+		uLongf zlen = len;
+
+		pthread_mutex_lock(&compress_lock);
+		if (f->cached == i) {
+			memcpy(buf + done, f->buf + lo, hi - lo);
+			pthread_mutex_unlock(&compress_lock);
+			done += hi - lo;
+			continue;
+		}
+		pthread_mutex_unlock(&compress_lock);
+		if (!z) {
+			/* one read for the compressed data of all the chunks still needed */
+			size_t n = f->offsets[last + 1] - f->offsets[i];
+			zbase = f->offsets[i];
+			if (!(z = malloc(n)) || !(chunk = malloc(f->chunk))) break;
+			if (pread(fd, z, n, zbase) != (ssize_t)n) break;
+			__sync_fetch_and_add(&compress_fetched, n);
+		}
+		/* a chunk that is wanted whole goes straight to buf */
+		char *to = lo == 0 && hi == len && i != last ? buf + done : chunk;
+		if (uncompress((Bytef *)to, &zlen, (Bytef *)z + (f->offsets[i] - zbase), f->offsets[i + 1] - f->offsets[i]) != Z_OK || zlen != len) break;
+		if (to == chunk) memcpy(buf + done, chunk + lo, hi - lo);
+		done += hi - lo;
+		if (i == last) {
+			pthread_mutex_lock(&compress_lock);
+			memcpy(f->buf, chunk, len);
+			f->cached = i;
+			pthread_mutex_unlock(&compress_lock);
+		}
+	}
+	free(z);
+	free(chunk);
+	if (i <= last) {
+		errno = EIO;
+		return -1;
+	}
+	__sync_fetch_and_add(&compress_returned, done);
+	return done;
+}
+
+static void *compress_thread(void *arg) {
+	struct compress_job *j;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&compress_lock);
+		while (!compress_head) pthread_cond_wait(&compress_work, &compress_lock);
+		j = compress_head;
+		if (!(compress_head = j->next)) compress_tail = &compress_head;
+		compress_queued--;
+		pthread_mutex_unlock(&compress_lock);
+
+		compress_claim(j->ino);
+		compress_path(j->path, j->ino);
+		compress_unclaim(j->ino);
+		free(j->path);
+		free(j);
+	}
+	return NULL;
+}
+
+static void compress_start() {
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, compress_thread, NULL) == 0) pthread_detach(tid);
+}
+
+static void compress_queue(const char *path, ino_t ino) {/*
+have the file at path compressed by the background thread
+*/
+	struct compress_job *j;
+
+	/* the thread is started here as fuse_main forks when it daemonizes */
+	pthread_once(&compress_once, compress_start);
+	pthread_mutex_lock(&compress_lock);
+	for (j = compress_head; j && j->ino != ino; j = j->next);
+	if (!j && compress_queued < COMPRESS_QUEUE_MAX && (j = calloc(1, sizeof(struct compress_job)))) {
+		if ((j->path = strdup(path))) {
+			j->ino = ino;
+			*compress_tail = j;
+			compress_tail = &j->next;
+			compress_queued++;
+			pthread_cond_signal(&compress_work);
+		}
+		else {
+			free(j);
+			j = NULL;
+		}
+	}
+	if (!j) compress_dropped++;
+	pthread_mutex_unlock(&compress_lock);
+}
+
+void compress_release(const char *path, int fd, int flags) {/*
+called before a descriptor from compress_opened is released, queues path for compression once its last writer is done
+*/
+	struct compress_file *f, **ff;
+	struct stat st;
+
+	if ((flags & 3) == O_RDONLY) {
+		pthread_mutex_lock(&compress_lock);
+		for (ff = &compress_files[fd % COMPRESS_BUCKETS]; (f = *ff) && f->fd != fd; ff = &f->next);
+		if (f && --f->refs == 0) *ff = f->next;
+		else f = NULL;
+		pthread_mutex_unlock(&compress_lock);
+		if (f) {
+			free(f->offsets);
+			free(f->buf);
+			free(f);
+		}
+		return;
+	}
+	if (fstat(fd, &st) == -1) return;
+	if (compress_writer(&st, 0) && path && st.st_dev == compress_dev && st.st_nlink == 1) compress_queue(path, st.st_ino);
+}
+
+void compress_unlinked(const struct stat *st) {/*
+st, taken just before, was unlinked or renamed over, forget it if that was its last link
+*/
+	if (compress_enabled && S_ISREG(st->st_mode) && st->st_dev == compress_dev && st->st_nlink == 1) {
+		pthread_mutex_lock(&compress_lock);
+		int marked = *compress_mark_find(st->st_ino) != NULL;
+		pthread_mutex_unlock(&compress_lock);
+		if (marked) compress_unmark(st->st_ino);
+	}
+}
+
+void compress_sprint(char *s) {
+	if (!compress_enabled) return;
+
+	sprintf(s, "Compression: %lu files compressed (%llu to %llu bytes), %lu not worth it, %lu expanded for writing\n",
+		compress_done, compress_in, compress_out, compress_skipped, compress_expanded);
+	sprintf(s+strlen(s), "Compression queue: %lu waiting, %lu left plain with the queue full\n", compress_queued, compress_dropped);
+	sprintf(s+strlen(s), "Compressed reads: %llu bytes fetched for %llu bytes read\n", compress_fetched, compress_returned);
+}
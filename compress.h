@@ -0,0 +1,34 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#define COMPRESS_DIRNAME "/.passfs-compress"   /* under root, holds the index and temporary files */
+#define COMPRESS_BUCKETS 4096
+#define COMPRESS_MAGIC "PASSFSZ1"    /* first bytes of a compressed backing file */
+#define COMPRESS_MIN_SIZE 4096       /* smaller files are left alone */
+#define COMPRESS_MIN_SAVING 8        /* must save at least 1/8 of the size to be kept */
+#define COMPRESS_QUEUE_MAX 1024      /* files waiting to be compressed, more are left plain */
+
+
+extern char compress_enabled;         /* compress files once written */
+extern unsigned long compress_chunk;  /* bytes of file data per chunk */
+
+void compress_init();
+int compress_load();
+int compress_reserved(const char *path);
+int compress_marked(const struct stat *st);
+void compress_stat(struct stat *st);
+int compress_prepare(const char *path, int flags);
+int compress_opened(const char *path, int fd, int flags);
+int compress_hold(const char *path, struct stat *st);
+void compress_unhold(const struct stat *st);
+ssize_t compress_pread(int fd, char *buf, size_t size, off_t offset);
+void compress_release(const char *path, int fd, int flags);
+void compress_unlinked(const struct stat *st);
+void compress_sprint(char *s);
+
+
+#endif
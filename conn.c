@@ -0,0 +1,85 @@
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fuse.h>
+
+#include "conn.h"
+/*
+Negotiation of the FUSE connection when the filesystem is mounted. By default
+passfs asks for big writes (writes larger than a page in one request), parallel
+reads and the largest readahead the kernel offers, the io_ options override that.
+Request sizes are clamped to CONN_MAX_REQUEST when the options are parsed.
+libfuse may still lower max_write to fit its own buffers after the init callback
+returns and the high level API does not show us the final value, so the stats
+report what was requested rather than what was agreed.
+*/
+
+unsigned int conn_max_write, conn_max_read, conn_max_readahead;
+char conn_sync_read, conn_splice, conn_page_cache;
+
+static struct {
+	int done;
+	unsigned proto_major, proto_minor;
+	unsigned capable, want;
+	unsigned async_read, max_write, max_readahead;
+} conn_result;
+
+
+void conn_init() {
+	conn_max_write = conn_max_read = conn_max_readahead = 0;
+	conn_sync_read = conn_splice = conn_page_cache = 0;
+	memset(&conn_result, 0, sizeof(conn_result));
+}
+
+unsigned int conn_clamp(unsigned long size) {/*
+a request size from the options within what the kernel can do, 0 stays 0 (default)
+*/
+	if (!size) return 0;
+	if (size < 4096) return 4096;
+	return size > CONN_MAX_REQUEST ? CONN_MAX_REQUEST : size;
+}
+
+void conn_negotiate(struct fuse_conn_info *conn) {
+	if (conn->capable & FUSE_CAP_BIG_WRITES) conn->want |= FUSE_CAP_BIG_WRITES;
+
+	if (conn_sync_read) {
+		conn->async_read = 0;
+		conn->want &= ~FUSE_CAP_ASYNC_READ;
+	}
+	else if (conn->capable & FUSE_CAP_ASYNC_READ) {
+		conn->async_read = 1;
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	}
+
+	if (conn_max_write) conn->max_write = conn_max_write;
+	/* the kernel offers its largest readahead, we may only ask for less */
+	if (conn_max_readahead && conn_max_readahead < conn->max_readahead) conn->max_readahead = conn_max_readahead;
+
+#ifdef FUSE_CAP_SPLICE_READ
+	if (conn_splice) conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+	if (conn_page_cache) conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#endif
+
+	conn_result.proto_major = conn->proto_major;
+	conn_result.proto_minor = conn->proto_minor;
+	conn_result.capable = conn->capable;
+	conn_result.want = conn->want;
+	conn_result.async_read = conn->async_read;
+	conn_result.max_write = conn->max_write;
+	conn_result.max_readahead = conn->max_readahead;
+	conn_result.done = 1;
+}
+
+void conn_sprint(char *s) {
+	if (!conn_result.done) return;
+
+	sprintf(s, "FUSE protocol %u.%u, capable 0x%x, wanted 0x%x\n", conn_result.proto_major, conn_result.proto_minor, conn_result.capable, conn_result.want);
+	sprintf(s+strlen(s), "Async read: %s, requested max write: %u, max read: %u, max readahead: %u, %s\n", conn_result.async_read ? "yes" : "no",
+		conn_result.max_write, conn_max_read, conn_result.max_readahead, conn_page_cache ? "page cache" : "direct I/O");
+}
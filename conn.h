@@ -0,0 +1,23 @@
+#ifndef CONN_H
+#define CONN_H
+
+
+#define CONN_MAX_REQUEST 131072    /* largest read or write the kernel sends a libfuse 2 filesystem (32 pages) */
+
+
+struct fuse_conn_info;
+
+extern unsigned int conn_max_write;       /* largest write request to ask for, 0 = libfuse default */
+extern unsigned int conn_max_read;        /* largest read request (the max_read mount option), 0 = kernel default */
+extern unsigned int conn_max_readahead;   /* readahead window to ask for, 0 = as much as the kernel offers */
+extern char conn_sync_read;               /* do not allow parallel reads of one file */
+extern char conn_splice;                  /* ask for splice transfers on the FUSE device */
+extern char conn_page_cache;              /* let the kernel cache file data instead of direct_io */
+
+void conn_init();
+unsigned int conn_clamp(unsigned long size);
+void conn_negotiate(struct fuse_conn_info *conn);
+void conn_sprint(char *s);
+
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 25
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <fuse.h>
+
+#include "userModeFS.h"
+#include "ctl.h"
+#include "stats.h"
+#include "qos.h"
+#include "dircache.h"
+#include "fsyncq.h"
+#include "trace.h"
+#include "tier.h"
+#include "conn.h"
+#include "fdcache.h"
+#include "sparse.h"
+#include "heat.h"
+/*
+The control file. Reading it gives the current settings as name=value lines and
+writing name=value lines to it changes them on the live filesystem, e.g.
+	echo dircache=4096 > mountpoint/control
+Only the user that mounted the filesystem (or root) may write to it. A line
+split across several writes is put together per open handle, a last line
+without a newline is applied on close.
+Settings fixed when the filesystem is mounted, such as the kernel attribute
+timeouts, can not be changed here.
+*/
+
+/* an open control file, holding a line not yet ended */
+struct ctl_handle {
+	pthread_mutex_t lock;
+	char line[256];
+	size_t len;
+	char overlong;              /* the line did not fit, it is rejected */
+};
+
+char ctl_enabled;
+
+static void ctl_qos_changed() {
+	qos_enabled = qos_bw || qos_iops;
+}
+
+static void ctl_dircache_changed() {
+	dircache_invalidate("/");   /* start again at the new size, closing everything when it is 0 */
+}
+
+/* the settings that can be changed, type is 'c' for char, 'i' int, 'u' unsigned int, 'l' unsigned long */
+static struct ctl_var {
+	const char *name;
+	char type;
+	void *var;
+	unsigned long max;
+	void (*changed)();
+} ctl_vars[] = {
+	{ "readdir_method2", 'i', &readdir_method2, 1, NULL },
+	{ "stats", 'c', &stats_enabled, 1, NULL },
+	{ "cputime", 'c', &trace_cputime, 1, NULL },
+	{ "qos_bw", 'l', &qos_bw, ~0UL, ctl_qos_changed },
+	{ "qos_iops", 'l', &qos_iops, ~0UL, ctl_qos_changed },
+	{ "qos_small", 'l', &qos_small, ~0UL, NULL },
+	{ "dircache", 'u', &dircache_size, ~0U, ctl_dircache_changed },
+	{ "fsync_window", 'l', &fsyncq_window, ~0UL, NULL },
+	{ "fsync_syncfs", 'u', &fsyncq_syncfs, ~0U, NULL },
+	{ "tier_budget", 'l', &tier_budget, ~0UL, NULL },
+	{ "tier_promote", 'l', &tier_promote, ~0UL, NULL },
+	{ "tier_interval", 'l', &tier_interval, ~0UL, NULL },
+	{ "io_page_cache", 'c', &conn_page_cache, 1, NULL },
+	{ "fdcache", 'u', &fdcache_max, ~0U, NULL },
+	{ "fd_linger", 'l', &fdcache_linger, ~0UL, NULL },
+	{ "sparse", 'c', &sparse_enabled, 1, NULL },
+	{ "heat_sample", 'u', &heat_sample, ~0U, NULL },
+	{ "heat_halflife", 'l', &heat_halflife, ~0UL, NULL },
+	{ "heat_range", 'l', &heat_range, ~0UL, NULL },
+	{ NULL, 0, NULL, 0, NULL }
+};
+
+
+void ctl_init() {
+	ctl_enabled = 0;
+}
+
+int ctl_allowed() {/*
+may the caller change settings
+*/
+	struct fuse_context *ctx = fuse_get_context();
+	return !ctx || ctx->uid == 0 || ctx->uid == getuid();
+}
+
+static int ctl_set(const char *name, const char *value) {/*
+apply one setting, returns 0 or -EINVAL
+*/
+	struct ctl_var *v;
+	char *end;
+
+	if (strcmp(name, "qos_class") == 0) return qos_set_key(value) ? -EINVAL : 0;
+	if (strcmp(name, "monitor") == 0) return monitorSet(strtol(value, NULL, 0)) ? -EINVAL : 0;
+
+	for (v = ctl_vars; v->name; v++) {
+		if (strcmp(name, v->name) != 0) continue;
+		errno = 0;
+		unsigned long n = strtoul(value, &end, 0);
+		if (errno || end == value || *end != '\0' || n > v->max) return -EINVAL;
+		switch (v->type) {
+			case 'c': *(char *)v->var = n; break;
+			case 'i': *(int *)v->var = n; break;
+			case 'u': *(unsigned int *)v->var = n; break;
+			default:  *(unsigned long *)v->var = n; break;
+		}
+		if (v->changed) v->changed();
+		return 0;
+	}
+	return -EINVAL;
+}
+
+void *ctl_open() {/*
+a handle for writing settings, NULL when out of memory
+*/
+	struct ctl_handle *h = calloc(1, sizeof(struct ctl_handle));
+	if (h) pthread_mutex_init(&h->lock, NULL);
+	return h;
+}
+
+static int ctl_line(struct ctl_handle *h) {/*
+apply the line held in h and empty it, returns 0 or -EINVAL
+*/
+	char *line = h->line, *value;
+	size_t len = h->len;
+	int overlong = h->overlong;
+
+	h->len = 0;
+	h->overlong = 0;
+	while (len && (line[len-1] == ' ' || line[len-1] == '\r')) len--;
+	line[len] = '\0';
+	if (overlong) return -EINVAL;
+	if (!len || line[0] == '#') return 0;
+	if (!(value = strchr(line, '='))) return -EINVAL;
+	*value++ = '\0';
+	return ctl_set(line, value);
+}
+
+int ctl_write(void *handle, const char *buf, size_t size) {/*
+apply the name=value lines in buf, keeping an unfinished last line for the next
+write, returns size or -EINVAL at the first bad line
+*/
+	struct ctl_handle *h = handle;
+	size_t i;
+	int res = 0;
+
+	pthread_mutex_lock(&h->lock);
+	for (i = 0; i < size && !res; i++) {
+		if (buf[i] == '\n') res = ctl_line(h);
+		else if (h->len < sizeof(h->line) - 1) h->line[h->len++] = buf[i];
+		else h->overlong = 1;
+	}
+	pthread_mutex_unlock(&h->lock);
+	return res ? res : (int)size;
+}
+
+int ctl_flush(void *handle) {/*
+apply a last line written without a newline, returns 0 or -EINVAL
+*/
+	struct ctl_handle *h = handle;
+
+	pthread_mutex_lock(&h->lock);
+	int res = h->len || h->overlong ? ctl_line(h) : 0;
+	pthread_mutex_unlock(&h->lock);
+	return res;
+}
+
+void ctl_release(void *handle) {
+	ctl_flush(handle);
+	pthread_mutex_destroy(&((struct ctl_handle *)handle)->lock);
+	free(handle);
+}
+
+void ctl_sprint(char *s) {
+	struct ctl_var *v;
+
+	sprintf(s, "monitor=%d\n", monitor);
+	for (v = ctl_vars; v->name; v++) {
+		unsigned long n;
+		switch (v->type) {
+			case 'c': n = *(char *)v->var; break;
+			case 'i': n = *(int *)v->var; break;
+			case 'u': n = *(unsigned int *)v->var; break;
+			default:  n = *(unsigned long *)v->var; break;
+		}
+		sprintf(s+strlen(s), "%s=%lu\n", v->name, n);
+	}
+	sprintf(s+strlen(s), "qos_class=%s\n", qos_key == 'g' ? "gid" : qos_key == 'p' ? "pid" : "uid");
+}
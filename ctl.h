@@ -0,0 +1,20 @@
+#ifndef CTL_H
+#define CTL_H
+
+
+#define CONTROL_FILENAME "/control"
+#define CONTROL_SIZE 4096
+
+
+extern char ctl_enabled;
+
+void ctl_init();
+int ctl_allowed();
+void *ctl_open();
+int ctl_write(void *handle, const char *buf, size_t size);
+int ctl_flush(void *handle);
+void ctl_release(void *handle);
+void ctl_sprint(char *s);
+
+
+#endif
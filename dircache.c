@@ -0,0 +1,256 @@
+#define _GNU_SOURCE        /* for O_PATH */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "userModeFS.h"
+#include "dircache.h"
+/*
+Cache of open directory descriptors. Every operation used to hand the kernel
+root + path and so paid for a lookup of every component of a deep path. Instead
+the parent directory of the path is looked up here, by its path relative to root,
+and the operation is done with the matching *at() call on the last component.
+A directory that is not cached is opened relative to its own (cached) parent, so
+a miss costs one openat() per missing level rather than a walk from root.
+
+Entries are kept on an LRU list limited to dircache_size. An entry that is still
+referenced when it is evicted or invalidated is only closed on its final put.
+Renaming or removing a directory (or unlinking a symlink, which may have been
+cached as the directory it points to) must call dircache_invalidate() as cached
+descriptors follow the directory and not the name. Cached entries are not checked
+against the path again, so the cache assumes passfs has the backing root to
+itself: when other processes rename or remove directories in root, mount with
+-o watch so their changes invalidate the cache too.
+*/
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+struct dircache_ent {
+	char *path;
+	int fd;
+	unsigned int refs;
+	char dead;                           /* no longer in the cache, close on final put */
+	struct dircache_ent *next;           /* hash chain */
+	struct dircache_ent *lru_prev, *lru_next;
+};
+
+unsigned int dircache_size;
+unsigned int dircache_hits, dircache_misses;
+
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dircache_ent *dircache_table[DIRCACHE_BUCKETS];
+static struct dircache_ent *lru_head, *lru_tail;
+static unsigned int dircache_count;
+static unsigned long dircache_gen;   /* bumped by every invalidation */
+
+
+void dircache_init() {
+	dircache_size = 0;
+	dircache_hits = dircache_misses = 0;
+	dircache_count = 0;
+	dircache_gen = 0;
+	lru_head = lru_tail = NULL;
+	memset(dircache_table, 0, sizeof(dircache_table));
+}
+
+static unsigned int dircache_hash(const char *s, size_t len) {
+	unsigned int h = 2166136261u;
+	while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % DIRCACHE_BUCKETS;
+}
+
+static void lru_unlink(struct dircache_ent *e) {
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else lru_head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push(struct dircache_ent *e) {
+	e->lru_prev = NULL;
+	e->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = e; else lru_tail = e;
+	lru_head = e;
+}
+
+static void dircache_free(struct dircache_ent *e) {
+	close(e->fd);
+	free(e->path);
+	free(e);
+}
+
+static void dircache_remove(struct dircache_ent *e) {/*
+take e out of the hash table and LRU, called with the lock held
+*/
+	struct dircache_ent **pp = &dircache_table[dircache_hash(e->path, strlen(e->path))];
+
+	while (*pp != e) pp = &(*pp)->next;
+	*pp = e->next;
+	lru_unlink(e);
+	dircache_count--;
+	if (e->refs) e->dead = 1;
+	else dircache_free(e);
+}
+
+static struct dircache_ent *dircache_find(const char *path, size_t len) {
+	struct dircache_ent *e = dircache_table[dircache_hash(path, len)];
+
+	while (e && (strncmp(e->path, path, len) != 0 || e->path[len] != '\0')) e = e->next;
+	return e;
+}
+
+static struct dircache_ent *dircache_get(const char *path, size_t len) {/*
+return a referenced entry for the first len characters of path (a directory,
+"/" for the root), or NULL with errno set
+*/
+	struct dircache_ent *e, *parent;
+	unsigned long gen;
+	int fd;
+
+	pthread_mutex_lock(&dircache_lock);
+	e = dircache_find(path, len);
+	if (e) {
+		e->refs++;
+		lru_unlink(e);
+		lru_push(e);
+		dircache_hits++;
+		pthread_mutex_unlock(&dircache_lock);
+		return e;
+	}
+	dircache_misses++;
+	gen = dircache_gen;
+	pthread_mutex_unlock(&dircache_lock);
+
+	if (len == 1) {
+		fd = open(root, O_PATH | O_DIRECTORY);
+	}
+	else {
+		size_t plen = len;
+		char leaf[PATHLEN_MAX];
+
+		while (plen > 0 && path[plen-1] != '/') plen--;
+		if (len - plen >= PATHLEN_MAX) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		memcpy(leaf, path + plen, len - plen);
+		leaf[len - plen] = '\0';
+		parent = dircache_get(path, plen > 1 ? plen - 1 : 1);
+		if (!parent) return NULL;
+		fd = openat(parent->fd, leaf, O_PATH | O_DIRECTORY);
+		struct dirref pref = { parent->fd, parent };
+		dircache_put(&pref);
+	}
+	if (fd == -1) return NULL;
+
+	e = malloc(sizeof(struct dircache_ent));
+	if (e) e->path = strndup(path, len);
+	if (!e || !e->path) {
+		free(e);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	e->fd = fd;
+	e->refs = 1;
+	e->dead = 0;
+	e->lru_prev = e->lru_next = NULL;
+
+	pthread_mutex_lock(&dircache_lock);
+	if (gen != dircache_gen) {
+		/* something was renamed or removed while we were opening, use the fd once only */
+		e->dead = 1;
+		pthread_mutex_unlock(&dircache_lock);
+		return e;
+	}
+	struct dircache_ent *other = dircache_find(path, len);
+	if (other) {
+		/* another thread got there first */
+		other->refs++;
+		pthread_mutex_unlock(&dircache_lock);
+		dircache_free(e);
+		return other;
+	}
+	unsigned int h = dircache_hash(path, len);
+	e->next = dircache_table[h];
+	dircache_table[h] = e;
+	lru_push(e);
+	dircache_count++;
+	while (dircache_count > dircache_size && lru_tail != e) dircache_remove(lru_tail);
+	pthread_mutex_unlock(&dircache_lock);
+	return e;
+}
+
+int dircache_lookup(const char *path, struct dirref *ref, const char **name) {/*
+find the directory holding path, on success returns 0 with ref holding the
+directory and name pointing at the last component of path within path.
+On failure returns -1 with errno set.
+*/
+	const char *slash = strrchr(path, '/');
+
+	ref->fd = -1;
+	ref->ent = NULL;
+	if (!slash) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (slash[1] == '\0') {
+		/* the root itself */
+		*name = ".";
+		ref->ent = dircache_get("/", 1);
+	}
+	else {
+		*name = slash + 1;
+		ref->ent = dircache_get(path, slash == path ? 1 : (size_t)(slash - path));
+	}
+	if (!ref->ent) return -1;
+	ref->fd = ref->ent->fd;
+	return 0;
+}
+
+void dircache_put(struct dirref *ref) {/*
+release a reference taken by dircache_lookup, preserves errno
+*/
+	struct dircache_ent *e = ref->ent;
+	int err = errno;
+
+	if (!e) return;
+	ref->ent = NULL;
+	pthread_mutex_lock(&dircache_lock);
+	if (--e->refs == 0 && e->dead) {
+		pthread_mutex_unlock(&dircache_lock);
+		dircache_free(e);
+	}
+	else pthread_mutex_unlock(&dircache_lock);
+	errno = err;
+}
+
+void dircache_invalidate(const char *path) {/*
+forget path and everything below it
+*/
+	size_t len = strlen(path);
+	struct dircache_ent *e, *next;
+
+	/* walked even with the cache turned off, it may still hold entries from before */
+	if (len == 1) len = 0;   /* "/" matches everything */
+	pthread_mutex_lock(&dircache_lock);
+	dircache_gen++;
+	for (e = lru_head; e; e = next) {
+		next = e->lru_next;
+		if (strncmp(e->path, path, len) == 0 && (e->path[len] == '\0' || e->path[len] == '/'))
+			dircache_remove(e);
+	}
+	pthread_mutex_unlock(&dircache_lock);
+}
+
+void dircache_sprint(char *s) {
+	if (!dircache_size) return;
+
+	sprintf(s, "Directory cache: %u/%u entries, hits/misses: %u/%u\n", dircache_count, dircache_size, dircache_hits, dircache_misses);
+}
@@ -0,0 +1,26 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+
+#define DIRCACHE_BUCKETS 1024
+
+
+struct dircache_ent;
+
+/* a held reference to a directory, fd is valid for *at() calls until dircache_put() */
+struct dirref {
+	int fd;
+	struct dircache_ent *ent;
+};
+
+extern unsigned int dircache_size;   /* number of directories kept open, 0 = cache off */
+extern unsigned int dircache_hits, dircache_misses;
+
+void dircache_init();
+int dircache_lookup(const char *path, struct dirref *ref, const char **name);
+void dircache_put(struct dirref *ref);
+void dircache_invalidate(const char *path);
+void dircache_sprint(char *s);
+
+
+#endif
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE        /* for the *at() calls */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fdcache.h"
+/*
+Shared backing descriptors. Opens of the same file (device and inode, after
+following symlinks) with the same flags share one descriptor. This is safe
+because passfs only does positioned I/O (pread/pwrite) on them. When the last
+user releases a descriptor it stays open for fdcache_linger milliseconds, so a
+tool that opens, reads and closes the same files over and over does not pay for
+open() and close() each time. The cache holds at most fdcache_max descriptors
+and the oldest unused ones are closed first to make room.
+
+A descriptor is only shared while the file's ctime is unchanged, so a chmod or
+chown made since it was opened is honoured by a fresh open(). Opens that must
+create or truncate the file are never shared.
+*/
+
+struct fdcache_ent {
+	dev_t dev;
+	ino_t ino;
+	int flags;
+	struct timespec ctime;
+	int fd;
+	unsigned int refs;
+	struct timespec idle_since;
+	struct fdcache_ent *key_next, *fd_next;   /* hash chains by key and by fd */
+	struct fdcache_ent *idle_prev, *idle_next; /* unused entries, oldest at the tail */
+};
+
+unsigned int fdcache_max;
+unsigned long fdcache_linger;
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fdcache_once = PTHREAD_ONCE_INIT;
+static struct fdcache_ent *by_key[FDCACHE_BUCKETS], *by_fd[FDCACHE_BUCKETS];
+static struct fdcache_ent *idle_head, *idle_tail;
+static unsigned int fdcache_count;
+static unsigned long fdcache_hits, fdcache_misses, fdcache_closes;
+
+
+void fdcache_init() {
+	fdcache_max = 0;
+	fdcache_linger = 1000;
+	fdcache_count = 0;
+	fdcache_hits = fdcache_misses = fdcache_closes = 0;
+	idle_head = idle_tail = NULL;
+	memset(by_key, 0, sizeof(by_key));
+	memset(by_fd, 0, sizeof(by_fd));
+}
+
+static unsigned int key_hash(dev_t dev, ino_t ino, int flags) {
+	return (unsigned int)((dev * 31 + ino) * 31 + flags) % FDCACHE_BUCKETS;
+}
+
+static void idle_unlink(struct fdcache_ent *e) {
+	if (e->idle_prev) e->idle_prev->idle_next = e->idle_next; else idle_head = e->idle_next;
+	if (e->idle_next) e->idle_next->idle_prev = e->idle_prev; else idle_tail = e->idle_prev;
+	e->idle_prev = e->idle_next = NULL;
+}
+
+static void fdcache_remove(struct fdcache_ent *e) {/*
+forget and close an unused entry, called with the lock held
+*/
+	struct fdcache_ent **pp;
+
+	for (pp = &by_key[key_hash(e->dev, e->ino, e->flags)]; *pp != e; pp = &(*pp)->key_next);
+	*pp = e->key_next;
+	for (pp = &by_fd[e->fd % FDCACHE_BUCKETS]; *pp != e; pp = &(*pp)->fd_next);
+	*pp = e->fd_next;
+	idle_unlink(e);
+	fdcache_count--;
+	fdcache_closes++;
+	close(e->fd);
+	free(e);
+}
+
+static void fdcache_expire() {/*
+close descriptors unused for longer than fdcache_linger, called with the lock held
+*/
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (idle_tail) {
+		long ms = (now.tv_sec - idle_tail->idle_since.tv_sec) * 1000 + (now.tv_nsec - idle_tail->idle_since.tv_nsec) / 1000000;
+		if (ms < (long)fdcache_linger && fdcache_count <= fdcache_max) break;
+		fdcache_remove(idle_tail);
+	}
+}
+
+static void *fdcache_thread(void *arg) {
+	(void)arg;
+	for (;;) {
+		struct timespec ts = { 0, 0 };
+		unsigned long ms = fdcache_linger / 2 + 10;
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&fdcache_lock);
+		fdcache_expire();
+		pthread_mutex_unlock(&fdcache_lock);
+	}
+	return NULL;
+}
+
+static void fdcache_start() {
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, fdcache_thread, NULL) == 0) pthread_detach(tid);
+}
+
+int fdcache_open(int dirfd, const char *name, int flags) {/*
+open name relative to dirfd like openat(), sharing a cached descriptor when possible
+*/
+	struct fdcache_ent *e;
+	struct stat st;
+	int fd;
+
+	if ((flags & O_TRUNC) || (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) return openat(dirfd, name, flags);
+	if (fstatat(dirfd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)) return openat(dirfd, name, flags);
+	flags &= ~(O_CREAT | O_NOCTTY);
+
+	/* the reaper is started here as fuse_main forks when it daemonizes */
+	pthread_once(&fdcache_once, fdcache_start);
+
+	pthread_mutex_lock(&fdcache_lock);
+	for (e = by_key[key_hash(st.st_dev, st.st_ino, flags)]; e; e = e->key_next) {
+		if (e->dev == st.st_dev && e->ino == st.st_ino && e->flags == flags &&
+		    e->ctime.tv_sec == st.st_ctim.tv_sec && e->ctime.tv_nsec == st.st_ctim.tv_nsec) break;
+	}
+	if (e) {
+		if (e->refs++ == 0) idle_unlink(e);
+		fdcache_hits++;
+		fd = e->fd;
+		pthread_mutex_unlock(&fdcache_lock);
+		return fd;
+	}
+	fdcache_misses++;
+	pthread_mutex_unlock(&fdcache_lock);
+
+	fd = openat(dirfd, name, flags);
+	if (fd == -1) return -1;
+	/* key on what was actually opened, the name may have changed since the fstatat */
+	if (fstat(fd, &st) == -1 || !(e = malloc(sizeof(struct fdcache_ent)))) return fd;
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->flags = flags;
+	e->ctime = st.st_ctim;
+	e->fd = fd;
+	e->refs = 1;
+	e->idle_prev = e->idle_next = NULL;
+
+	pthread_mutex_lock(&fdcache_lock);
+	if (fdcache_count >= fdcache_max) {
+		while (idle_tail && fdcache_count >= fdcache_max) fdcache_remove(idle_tail);
+		if (fdcache_count >= fdcache_max) {
+			/* everything cached is in use, this one is not shared */
+			pthread_mutex_unlock(&fdcache_lock);
+			free(e);
+			return fd;
+		}
+	}
+	unsigned int h = key_hash(e->dev, e->ino, e->flags);
+	e->key_next = by_key[h];
+	by_key[h] = e;
+	e->fd_next = by_fd[fd % FDCACHE_BUCKETS];
+	by_fd[fd % FDCACHE_BUCKETS] = e;
+	fdcache_count++;
+	pthread_mutex_unlock(&fdcache_lock);
+	return fd;
+}
+
+int fdcache_release(int fd) {/*
+give back a descriptor from fdcache_open (or any other), returns like close()
+*/
+	struct fdcache_ent *e;
+
+	if (!fdcache_count) return close(fd);   /* can not be ours, ours keep the count up */
+
+	pthread_mutex_lock(&fdcache_lock);
+	for (e = by_fd[fd % FDCACHE_BUCKETS]; e && e->fd != fd; e = e->fd_next);
+	if (!e) {
+		pthread_mutex_unlock(&fdcache_lock);
+		return close(fd);
+	}
+	if (--e->refs == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &e->idle_since);
+		e->idle_prev = NULL;
+		e->idle_next = idle_head;
+		if (idle_head) idle_head->idle_prev = e; else idle_tail = e;
+		idle_head = e;
+		fdcache_expire();
+	}
+	pthread_mutex_unlock(&fdcache_lock);
+	return 0;
+}
+
+void fdcache_sprint(char *s) {
+	if (!fdcache_max) return;
+
+	sprintf(s, "Shared descriptors: %u/%u open, hits/misses: %lu/%lu, closed: %lu\n", fdcache_count, fdcache_max, fdcache_hits, fdcache_misses, fdcache_closes);
+}
@@ -0,0 +1,17 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+
+#define FDCACHE_BUCKETS 1024
+
+
+extern unsigned int fdcache_max;       /* descriptors the cache may hold, 0 = sharing off */
+extern unsigned long fdcache_linger;   /* milliseconds an unused descriptor is kept open */
+
+void fdcache_init();
+int fdcache_open(int dirfd, const char *name, int flags);
+int fdcache_release(int fd);
+void fdcache_sprint(char *s);
+
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE        /* for syncfs() */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef F_FULLFSYNC
+/* this is a Mac OS X system which does not implement fdatasync as such */
+#define fdatasync(f) fcntl(f, F_FULLFSYNC)
+#endif
+
+#include "fsyncq.h"
+/*
+Group commit for fsync. The first caller to arrive becomes the leader, waits
+fsyncq_window microseconds for others to queue behind it, then takes the whole
+queue and flushes it: one fsync (or fdatasync if every request for it asked only
+for that) per distinct descriptor. Once fsyncq_syncfs or more descriptors on one
+filesystem are pending a single syncfs writes them all back first, the fsync
+that still follows for each descriptor then finds its data clean and is cheap,
+but it is what reports a writeback error of that file: syncfs only reports
+errors against the descriptor it was called on, and only on Linux 5.8 or later.
+Everyone in the batch gets the result of the flush that covered their descriptor. Requests that arrive while
+a batch is being flushed wait for the next one, so every flush a caller is told
+about was started after that caller asked for it.
+*/
+
+struct fsyncq_req {
+	int fd;
+	int datasync;
+	int res;                       /* 0 or an errno value */
+	int syncfs_res;                /* result of a syncfs of its filesystem, -1 if none */
+	int done;
+	dev_t dev;
+	struct fsyncq_req *next;
+};
+
+unsigned long fsyncq_window;
+unsigned int fsyncq_syncfs;
+
+static pthread_mutex_t fsyncq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fsyncq_cond = PTHREAD_COND_INITIALIZER;
+static struct fsyncq_req *fsyncq_pending;
+static int fsyncq_leader;
+
+static unsigned long fsyncq_requests, fsyncq_batches, fsyncq_flushes, fsyncq_syncfss;
+
+
+void fsyncq_init() {
+	fsyncq_window = 0;
+	fsyncq_syncfs = 0;
+	fsyncq_pending = NULL;
+	fsyncq_leader = 0;
+	fsyncq_requests = fsyncq_batches = fsyncq_flushes = fsyncq_syncfss = 0;
+}
+
+static void fsyncq_flush(struct fsyncq_req *batch) {/*
+flush every descriptor in batch and set each request's result
+*/
+	struct fsyncq_req *r, *o;
+
+	for (r = batch; r; r = r->next) {
+		struct stat st;
+		r->done = 0;
+		r->res = -1;
+		r->syncfs_res = -1;
+		r->dev = fstat(r->fd, &st) == 0 ? st.st_dev : 0;
+	}
+
+#ifdef __linux__
+	if (fsyncq_syncfs) {
+		for (r = batch; r; r = r->next) {
+			unsigned int files = 0;
+			if (r->syncfs_res != -1) continue;
+			for (o = r; o; o = o->next) {
+				/* count distinct descriptors on this filesystem */
+				if (o->dev != r->dev || o->syncfs_res != -1) continue;
+				struct fsyncq_req *s;
+				for (s = r; s != o && s->fd != o->fd; s = s->next);
+				if (s == o) files++;
+			}
+			if (files < fsyncq_syncfs) continue;
+			int res = syncfs(r->fd) == -1 ? errno : 0;
+			fsyncq_syncfss++;
+			for (o = r; o; o = o->next) if (o->dev == r->dev && o->syncfs_res == -1) o->syncfs_res = res;
+		}
+	}
+#endif
+
+	for (r = batch; r; r = r->next) {
+		if (r->res != -1) continue;
+		int datasync = 1;
+		for (o = r; o; o = o->next) if (o->fd == r->fd && !o->datasync) datasync = 0;
+		int res = (datasync ? fdatasync(r->fd) : fsync(r->fd)) == -1 ? errno : 0;
+		fsyncq_flushes++;
+		for (o = r; o; o = o->next) {
+			if (o->fd == r->fd && o->res == -1) o->res = res ? res : o->syncfs_res > 0 ? o->syncfs_res : 0;
+		}
+	}
+}
+
+int fsyncq_sync(int fd, int isdatasync) {/*
+fsync or fdatasync fd as part of a group, returns 0 or -1 with errno set
+*/
+	struct fsyncq_req req;
+	struct fsyncq_req *batch, *r;
+
+	req.fd = fd;
+	req.datasync = isdatasync;
+	req.done = 0;
+
+	pthread_mutex_lock(&fsyncq_lock);
+	req.next = fsyncq_pending;
+	fsyncq_pending = &req;
+	fsyncq_requests++;
+	while (!req.done) {
+		if (fsyncq_leader) {
+			pthread_cond_wait(&fsyncq_cond, &fsyncq_lock);
+			continue;
+		}
+		fsyncq_leader = 1;
+		pthread_mutex_unlock(&fsyncq_lock);
+
+		struct timespec ts;
+		ts.tv_sec = fsyncq_window / 1000000;
+		ts.tv_nsec = (fsyncq_window % 1000000) * 1000;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+
+		pthread_mutex_lock(&fsyncq_lock);
+		batch = fsyncq_pending;
+		fsyncq_pending = NULL;
+		fsyncq_batches++;
+		pthread_mutex_unlock(&fsyncq_lock);
+
+		fsyncq_flush(batch);
+
+		pthread_mutex_lock(&fsyncq_lock);
+		for (r = batch; r; r = r->next) r->done = 1;
+		fsyncq_leader = 0;
+		pthread_cond_broadcast(&fsyncq_cond);
+	}
+	pthread_mutex_unlock(&fsyncq_lock);
+
+	if (req.res) {
+		errno = req.res;
+		return -1;
+	}
+	return 0;
+}
+
+void fsyncq_sprint(char *s) {
+	if (!fsyncq_window) return;
+
+	sprintf(s, "Group fsync: %lu requests in %lu batches, %lu fsyncs, %lu syncfs\n", fsyncq_requests, fsyncq_batches, fsyncq_flushes, fsyncq_syncfss);
+}
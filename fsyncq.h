@@ -0,0 +1,13 @@
+#ifndef FSYNCQ_H
+#define FSYNCQ_H
+
+
+extern unsigned long fsyncq_window;    /* microseconds to collect fsync requests, 0 = group commit off */
+extern unsigned int fsyncq_syncfs;     /* files pending on one filesystem at which a single syncfs is used, 0 = never */
+
+void fsyncq_init();
+int fsyncq_sync(int fd, int isdatasync);
+void fsyncq_sprint(char *s);
+
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "heat.h"
+/*
+Access heat map. One read or write in heat_sample is recorded against its file
+and against the offset range (heat_range bytes) it starts in. Every count decays
+exponentially with a half-life of heat_halflife seconds, so the scores reflect
+recent use. The table is fixed in size: a file is looked for in HEAT_PROBE slots
+from its hash, and when they are all taken the coldest of them is replaced.
+The dump lists files hottest first as
+	score reads writes bytes path range:score ...
+where reads, writes and bytes are decayed estimates (samples times heat_sample).
+*/
+
+struct heat_ent {
+	char *path;
+	double score, reads, writes, bytes;
+	double ranges[HEAT_RANGES];
+	double last;               /* time the counts were last decayed */
+};
+
+char heat_enabled;
+unsigned int heat_sample, heat_files;
+unsigned long heat_halflife, heat_range;
+
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct heat_ent *heat_table;
+static unsigned int heat_size;        /* slots in heat_table */
+static unsigned long heat_counter, heat_evictions;
+
+
+void heat_init() {
+	heat_enabled = 0;
+	heat_sample = 16;
+	heat_files = 4096;
+	heat_halflife = 600;
+	heat_range = 64UL << 20;
+	heat_table = NULL;
+	heat_size = 0;
+	heat_counter = heat_evictions = 0;
+}
+
+static double heat_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int heat_hash(const char *s) {
+	unsigned int h = 2166136261u;
+	while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static void heat_decay(struct heat_ent *e, double now) {
+	int i;
+
+	if (now <= e->last) return;
+	double f = heat_halflife ? exp2(-(now - e->last) / heat_halflife) : 1;
+	e->score *= f;
+	e->reads *= f;
+	e->writes *= f;
+	e->bytes *= f;
+	for (i = 0; i < HEAT_RANGES; i++) e->ranges[i] *= f;
+	e->last = now;
+}
+
+void heat_note(const char *path, off_t offset, size_t size, int write) {/*
+count a read or write of size bytes at offset in path, if it is sampled
+*/
+	unsigned int i, slot, h;
+	struct heat_ent *e = NULL, *coldest = NULL;
+	double now;
+
+	if (heat_sample > 1 && __sync_fetch_and_add(&heat_counter, 1) % heat_sample) return;
+
+	now = heat_now();
+	pthread_mutex_lock(&heat_lock);
+	if (!heat_table) {
+		heat_size = heat_files ? heat_files : 1;
+		heat_table = calloc(heat_size, sizeof(struct heat_ent));
+		if (!heat_table) {
+			pthread_mutex_unlock(&heat_lock);
+			return;
+		}
+	}
+	h = heat_hash(path);
+	for (i = 0; i < HEAT_PROBE && i < heat_size; i++) {
+		slot = (h + i) % heat_size;
+		struct heat_ent *s = &heat_table[slot];
+		if (!s->path) {
+			if (!e) e = s;
+			continue;
+		}
+		if (strcmp(s->path, path) == 0) {
+			e = s;
+			break;
+		}
+		heat_decay(s, now);
+		if (!coldest || s->score < coldest->score) coldest = s;
+	}
+	if (!e || !e->path || strcmp(e->path, path) != 0) {
+		if (!e) {
+			e = coldest;
+			heat_evictions++;
+		}
+		free(e->path);
+		memset(e, 0, sizeof(struct heat_ent));
+		if (!(e->path = strdup(path))) {
+			pthread_mutex_unlock(&heat_lock);
+			return;
+		}
+		e->last = now;
+	}
+
+	double weight = heat_sample ? heat_sample : 1;
+	unsigned long r = heat_range ? offset / heat_range : 0;
+	heat_decay(e, now);
+	e->score += weight;
+	if (write) e->writes += weight; else e->reads += weight;
+	e->bytes += weight * size;
+	e->ranges[r < HEAT_RANGES ? r : HEAT_RANGES - 1] += weight;
+	pthread_mutex_unlock(&heat_lock);
+}
+
+static int heat_cmp(const void *a, const void *b) {
+	const struct heat_ent *x = a, *y = b;
+	return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+char *heat_dump() {/*
+return the heat map as a malloc'ed string, hottest first
+*/
+	struct heat_ent *copy;
+	unsigned int i, n = 0;
+	size_t cap = 256;
+	int j;
+	double now = heat_now();
+
+	pthread_mutex_lock(&heat_lock);
+	copy = malloc((heat_size ? heat_size : 1) * sizeof(struct heat_ent));
+	if (!copy) {
+		pthread_mutex_unlock(&heat_lock);
+		return NULL;
+	}
+	for (i = 0; i < heat_size; i++) {
+		if (!heat_table[i].path) continue;
+		heat_decay(&heat_table[i], now);
+		copy[n] = heat_table[i];
+		if (!(copy[n].path = strdup(heat_table[i].path))) break;
+		cap += strlen(copy[n].path) + 80 + HEAT_RANGES * 16;
+		n++;
+	}
+	unsigned long evictions = heat_evictions;
+	pthread_mutex_unlock(&heat_lock);
+
+	qsort(copy, n, sizeof(struct heat_ent), heat_cmp);
+
+	char *out = malloc(cap);
+	size_t used = 0;
+	if (out) {
+		used += snprintf(out, cap, "# sampled 1/%u, half-life %lus, range %lu bytes, %u files, %lu evicted\n"
+			"# score reads writes bytes path range:score...\n", heat_sample, heat_halflife, heat_range, n, evictions);
+		for (i = 0; i < n && used < cap; i++) {
+			struct heat_ent *e = &copy[i];
+			used += snprintf(out + used, cap - used, "%.1f %.0f %.0f %.0f %s", e->score, e->reads, e->writes, e->bytes, e->path);
+			for (j = 0; j < HEAT_RANGES && used < cap; j++) {
+				if (e->ranges[j] >= 0.05) used += snprintf(out + used, cap - used, " %d:%.1f", j, e->ranges[j]);
+			}
+			if (used < cap) used += snprintf(out + used, cap - used, "\n");
+		}
+		if (used >= cap) used = cap - 1;
+	}
+	for (i = 0; i < n; i++) free(copy[i].path);
+	free(copy);
+	return out;
+}
@@ -0,0 +1,23 @@
+#ifndef HEAT_H
+#define HEAT_H
+
+#include <sys/types.h>
+
+
+#define HEATMAP_FILENAME "/heatmap"
+#define HEAT_RANGES 16          /* offset ranges tracked per file, the last one takes everything beyond */
+#define HEAT_PROBE 8            /* table slots searched for a file before one is evicted */
+
+
+extern char heat_enabled;
+extern unsigned int heat_sample;      /* record one access in this many */
+extern unsigned int heat_files;       /* files tracked at most */
+extern unsigned long heat_halflife;   /* seconds for a score to halve */
+extern unsigned long heat_range;      /* bytes per offset range */
+
+void heat_init();
+void heat_note(const char *path, off_t offset, size_t size, int write);
+char *heat_dump();
+
+
+#endif
@@ -4,6 +4,7 @@
 
 CFLAGS="${CFLAGS:--Wall}"
 CPPFLAGS="${CPPFLAGS} -D_FILE_OFFSET_BITS=64 -DFUSE_USE_VERSION=26"
-LDFLAGS="${LDFLAGS} -lfuse"
+LDFLAGS="${LDFLAGS} -lfuse -lpthread -lm -lz"
+[ -f /usr/include/sys/sdt.h ] && CPPFLAGS="${CPPFLAGS} -DHAVE_SYS_SDT_H"
 
 ${CC} ${CPPFLAGS} ${CFLAGS} ${LDFLAGS} -o passfs *.c "$@"
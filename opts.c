@@ -16,6 +16,19 @@ Note specifically the enum and the fuse opt struct below which determine the ava
 
 #include "userModeFS.h"    /*interfaces relating to the main file system module */
 #include "stats.h"         /*interfaces relating to stats module */
+#include "qos.h"           /*interfaces relating to the I/O scheduler */
+#include "dircache.h"      /*interfaces relating to the directory cache */
+#include "fsyncq.h"        /*interfaces relating to group fsync */
+#include "trace.h"         /*interfaces relating to probes and CPU accounting */
+#include "ctl.h"           /*interfaces relating to the control file */
+#include "tier.h"          /*interfaces relating to the fast tier */
+#include "conn.h"          /*interfaces relating to the FUSE connection settings */
+#include "fdcache.h"       /*interfaces relating to shared backing descriptors */
+#include "sparse.h"        /*interfaces relating to hole aware reads */
+#include "heat.h"          /*interfaces relating to the access heat map */
+#include "pack.h"          /*interfaces relating to small file packing */
+#include "watch.h"         /*interfaces relating to the backing root watcher */
+#include "compress.h"      /*interfaces relating to transparent compression */
 #include "debug.h"         /*interfaces relating to the debug option */
 /* This module borrowed from Radek Podgorny unionfs-fuse  with customisations by JC*/
 int use_readir_method2;
@@ -33,6 +46,38 @@ enum {
 	KEY_MONITOR,      /*the monitor flag -m */
 	KEY_MONITOR_FILE, /*the monitor file value -m= */
 	KEY_DIR_METHOD2,  /*the read dir method flag -D */
+	KEY_QOS_BW,       /*the per class bandwidth limit -o qos_bw= */
+	KEY_QOS_IOPS,     /*the per class request rate limit -o qos_iops= */
+	KEY_QOS_SMALL,    /*the small I/O size -o qos_small= */
+	KEY_QOS_CLASS,    /*what requests are classified by -o qos_class= */
+	KEY_DIRCACHE,     /*the number of directories kept open -o dircache= */
+	KEY_FSYNC_WINDOW, /*the group fsync collection window -o fsync_window= */
+	KEY_FSYNC_SYNCFS, /*the files pending before syncfs is used -o fsync_syncfs= */
+	KEY_CPUTIME,      /*the per callback CPU accounting option -o cputime */
+	KEY_CONTROL,      /*the control file option -o control */
+	KEY_FAST_ROOT,    /*the fast tier directory -o fast_root= */
+	KEY_TIER_BUDGET,  /*the bytes the fast tier may hold -o tier_budget= */
+	KEY_TIER_PROMOTE, /*the opens before promotion -o tier_promote= */
+	KEY_TIER_INTERVAL,/*the seconds between tiering passes -o tier_interval= */
+	KEY_IO_MAX_WRITE, /*the largest write request -o io_max_write= */
+	KEY_IO_MAX_READ,  /*the largest read request -o io_max_read= */
+	KEY_IO_READAHEAD, /*the readahead window -o io_max_readahead= */
+	KEY_IO_SYNC_READ, /*no parallel reads -o io_sync_read */
+	KEY_IO_SPLICE,    /*splice on the FUSE device -o io_splice */
+	KEY_IO_PAGE_CACHE,/*kernel page cache instead of direct_io -o io_page_cache */
+	KEY_FDCACHE,      /*the number of shared backing descriptors -o fdcache= */
+	KEY_FD_LINGER,    /*how long unused descriptors stay open -o fd_linger= */
+	KEY_SPARSE,       /*the hole aware read option -o sparse */
+	KEY_HEATMAP,      /*the heat map file option -o heatmap */
+	KEY_HEAT_SAMPLE,  /*the heat map sampling rate -o heat_sample= */
+	KEY_HEAT_FILES,   /*the files in the heat map -o heat_files= */
+	KEY_HEAT_HALFLIFE,/*the heat map decay -o heat_halflife= */
+	KEY_HEAT_RANGE,   /*the heat map offset range size -o heat_range= */
+	KEY_PACK,         /*the small file packing threshold -o pack= */
+	KEY_WATCH,        /*the backing root watcher option -o watch */
+	KEY_WATCH_MAX,    /*the most directories watched -o watch_max= */
+	KEY_COMPRESS,     /*the transparent compression option -o compress */
+	KEY_COMPRESS_CHUNK,/*the compression chunk size -o compress_chunk= */
 	KEY_DEMO_INT,     /*the demo integer value -i=%lu */
 	KEY_DEMO_STRING,  /*the demo string value -s=%s */
 	KEY_DEMO_SPACE    /*the demo flag followed by value -n */
@@ -51,6 +96,38 @@ static struct fuse_opt userModeFS_opts[] = {
 	FUSE_OPT_KEY("-m",KEY_MONITOR),
 	FUSE_OPT_KEY("-m=",KEY_MONITOR_FILE),
 	FUSE_OPT_KEY("-D",KEY_DIR_METHOD2),
+	FUSE_OPT_KEY("qos_bw=",KEY_QOS_BW),
+	FUSE_OPT_KEY("qos_iops=",KEY_QOS_IOPS),
+	FUSE_OPT_KEY("qos_small=",KEY_QOS_SMALL),
+	FUSE_OPT_KEY("qos_class=",KEY_QOS_CLASS),
+	FUSE_OPT_KEY("dircache=",KEY_DIRCACHE),
+	FUSE_OPT_KEY("fsync_window=",KEY_FSYNC_WINDOW),
+	FUSE_OPT_KEY("fsync_syncfs=",KEY_FSYNC_SYNCFS),
+	FUSE_OPT_KEY("cputime",KEY_CPUTIME),
+	FUSE_OPT_KEY("control",KEY_CONTROL),
+	FUSE_OPT_KEY("fast_root=",KEY_FAST_ROOT),
+	FUSE_OPT_KEY("tier_budget=",KEY_TIER_BUDGET),
+	FUSE_OPT_KEY("tier_promote=",KEY_TIER_PROMOTE),
+	FUSE_OPT_KEY("tier_interval=",KEY_TIER_INTERVAL),
+	FUSE_OPT_KEY("io_max_write=",KEY_IO_MAX_WRITE),
+	FUSE_OPT_KEY("io_max_read=",KEY_IO_MAX_READ),
+	FUSE_OPT_KEY("io_max_readahead=",KEY_IO_READAHEAD),
+	FUSE_OPT_KEY("io_sync_read",KEY_IO_SYNC_READ),
+	FUSE_OPT_KEY("io_splice",KEY_IO_SPLICE),
+	FUSE_OPT_KEY("io_page_cache",KEY_IO_PAGE_CACHE),
+	FUSE_OPT_KEY("fdcache=",KEY_FDCACHE),
+	FUSE_OPT_KEY("fd_linger=",KEY_FD_LINGER),
+	FUSE_OPT_KEY("sparse",KEY_SPARSE),
+	FUSE_OPT_KEY("heatmap",KEY_HEATMAP),
+	FUSE_OPT_KEY("heat_sample=",KEY_HEAT_SAMPLE),
+	FUSE_OPT_KEY("heat_files=",KEY_HEAT_FILES),
+	FUSE_OPT_KEY("heat_halflife=",KEY_HEAT_HALFLIFE),
+	FUSE_OPT_KEY("heat_range=",KEY_HEAT_RANGE),
+	FUSE_OPT_KEY("pack=",KEY_PACK),
+	FUSE_OPT_KEY("watch",KEY_WATCH),
+	FUSE_OPT_KEY("watch_max=",KEY_WATCH_MAX),
+	FUSE_OPT_KEY("compress",KEY_COMPRESS),
+	FUSE_OPT_KEY("compress_chunk=",KEY_COMPRESS_CHUNK),
 /* the next entries are for demonstration purposes only: they have no useful function*/
 	/*-x value form*/
 	FUSE_OPT_KEY("-n ",KEY_DEMO_SPACE),
@@ -94,6 +171,12 @@ and return a pointer to it, will return NULL if unsuccessful.
 	}
 	return newName;
 }
+static const char *opt_value(const char *arg) {/*
+return the value part of a name=value option
+*/
+	const char *v = strchr(arg, '=');
+	return v ? v+1 : "";
+}
 /* end service routines */
 
 /* the parameter analysis call back procedure */
@@ -135,6 +218,40 @@ return -1 to indicate error
 			"    -m=file                monitor to file"
 			"    -D                     implement use of offset in readdir interface"
 			"    -o stats               show statistics in the file 'stats' under the mountpoint\n"
+			"    -o qos_bw=N            limit each user to N bytes per second of bulk I/O\n"
+			"    -o qos_iops=N          limit each user to N read/write requests per second\n"
+			"    -o qos_small=N         requests up to N bytes skip the bandwidth limit (default 65536)\n"
+			"    -o qos_class=uid|gid|pid  what the limits are applied to (default uid)\n"
+			"    -o dircache=N          keep up to N directories open to shorten path lookups\n"
+			"                           (assumes no one else renames directories in root, see -o watch)\n"
+			"    -o fsync_window=N      collect concurrent fsyncs for N microseconds and flush them together\n"
+			"    -o fsync_syncfs=N      write back with one syncfs when N or more files on a filesystem are waiting\n"
+			"                           (each file is still fsynced after it for its own error)\n"
+			"    -o cputime             account CPU time per callback, shown in the stats file\n"
+			"    -o control             change settings at run time through the file 'control' under the mountpoint\n"
+			"    -o fast_root=dir       keep copies of frequently read files in dir (e.g. on flash)\n"
+			"    -o tier_budget=N       bytes the fast root may hold (default 1GiB)\n"
+			"    -o tier_promote=N      read opens before a file is copied to the fast root (default 4)\n"
+			"    -o tier_interval=N     seconds between promotion/demotion passes (default 5)\n"
+			"    -o io_max_write=N      largest write request to ask the kernel for (at most 128KiB)\n"
+			"    -o io_max_read=N       largest read request the kernel should send (at most 128KiB)\n"
+			"    -o io_max_readahead=N  readahead window to ask for (default the most the kernel offers)\n"
+			"    -o io_sync_read        do not let the kernel issue parallel reads\n"
+			"    -o io_splice           use splice to move data over the FUSE device where possible\n"
+			"    -o io_page_cache       let the kernel cache file data (and read ahead) instead of direct I/O\n"
+			"    -o fdcache=N           share up to N backing descriptors between opens of the same file\n"
+			"    -o fd_linger=N         milliseconds an unused shared descriptor stays open (default 1000)\n"
+			"    -o sparse              zero fill holes in sparse files instead of reading them\n"
+			"    -o heatmap             show which files and offsets are used most in the file 'heatmap'\n"
+			"    -o heat_sample=N       record one read/write in N (default 16)\n"
+			"    -o heat_files=N        files tracked in the heat map (default 4096)\n"
+			"    -o heat_halflife=N     seconds for heat to halve (default 600)\n"
+			"    -o heat_range=N        bytes per offset range within a file (default 64MiB)\n"
+			"    -o pack=N              keep new files of up to N bytes in a single pack file\n"
+			"    -o watch               drop cached state for paths changed directly in the root directory\n"
+			"    -o watch_max=N         most directories to watch (default 8192)\n"
+			"    -o compress            store files compressed once written, reads inflate only the chunks they need\n"
+			"    -o compress_chunk=N    bytes of file data per compressed chunk (default 65536)\n"
 			"for other options use -H\n"
 			"\n",
 			outargs->argv[0]);
@@ -156,6 +273,118 @@ return -1 to indicate error
 		case KEY_DIR_METHOD2:  /*-D use the offset style of working in readdir interface */
 			use_readir_method2=1;
 			return 0;
+		case KEY_QOS_BW:
+			qos_bw = strtoul(opt_value(arg), NULL, 0);
+			qos_enabled = qos_bw || qos_iops;
+			return 0;
+		case KEY_QOS_IOPS:
+			qos_iops = strtoul(opt_value(arg), NULL, 0);
+			qos_enabled = qos_bw || qos_iops;
+			return 0;
+		case KEY_QOS_SMALL:
+			qos_small = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_QOS_CLASS:
+			if (qos_set_key(opt_value(arg))) {
+				fprintf(stderr, "unknown qos_class %s, use uid, gid or pid\n", opt_value(arg));
+				return -1;
+			}
+			return 0;
+		case KEY_DIRCACHE:
+			dircache_size = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_FSYNC_WINDOW:
+			fsyncq_window = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_FSYNC_SYNCFS:
+			fsyncq_syncfs = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_CPUTIME:
+			trace_cputime = 1;
+			return 0;
+		case KEY_CONTROL:
+			ctl_enabled = 1;
+			return 0;
+		case KEY_FAST_ROOT:
+			if (tier_root) free(tier_root);
+			tier_root = make_absolute(opt_value(arg));
+			return tier_root ? 0 : -1;
+		case KEY_TIER_BUDGET:
+			tier_budget = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_TIER_PROMOTE:
+			tier_promote = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_TIER_INTERVAL:
+			tier_interval = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_IO_MAX_WRITE:
+			conn_max_write = conn_clamp(strtoul(opt_value(arg), NULL, 0));
+			return 0;
+		case KEY_IO_MAX_READ:
+			conn_max_read = conn_clamp(strtoul(opt_value(arg), NULL, 0));
+			if (conn_max_read) {
+				/* max_read is a mount option, hand it on to FUSE */
+				char opt[32];
+				snprintf(opt, sizeof(opt), "-omax_read=%u", conn_max_read);
+				fuse_opt_add_arg(outargs, opt);
+			}
+			return 0;
+		case KEY_IO_READAHEAD:
+			conn_max_readahead = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_IO_SYNC_READ:
+			conn_sync_read = 1;
+			return 0;
+		case KEY_IO_SPLICE:
+			conn_splice = 1;
+			return 0;
+		case KEY_IO_PAGE_CACHE:
+			conn_page_cache = 1;
+			return 0;
+		case KEY_FDCACHE:
+			fdcache_max = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_FD_LINGER:
+			fdcache_linger = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_SPARSE:
+			sparse_enabled = 1;
+			return 0;
+		case KEY_HEATMAP:
+			heat_enabled = 1;
+			return 0;
+		case KEY_HEAT_SAMPLE:
+			heat_sample = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_HEAT_FILES:
+			heat_files = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_HEAT_HALFLIFE:
+			heat_halflife = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_HEAT_RANGE:
+			heat_range = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_PACK:
+			pack_threshold = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_WATCH:
+			watch_enabled = 1;
+			return 0;
+		case KEY_WATCH_MAX:
+			watch_max = strtoul(opt_value(arg), NULL, 0);
+			return 0;
+		case KEY_COMPRESS:
+			compress_enabled = 1;
+			return 0;
+		case KEY_COMPRESS_CHUNK:
+			compress_chunk = strtoul(opt_value(arg), NULL, 0);
+			if (compress_chunk < 4096 || compress_chunk > (1 << 24)) {
+				fprintf(stderr, "compress_chunk must be between 4096 and 16777216\n");
+				return -1;
+			}
+			return 0;
 		case KEY_MONITOR_FILE:
 			{
 				const char *fp=&arg[3];
@@ -183,6 +412,19 @@ int main(int argc, char *argv[]) {
 	if (res != 0) return res;
 	/*initialise values */
 	stats_init();
+	qos_init();
+	dircache_init();
+	fsyncq_init();
+	trace_init();
+	ctl_init();
+	tier_init();
+	conn_init();
+	fdcache_init();
+	sparse_init();
+	heat_init();
+	pack_init();
+	watch_init();
+	compress_init();
 	optData.intval=0;
 	optData.stringval=NULL;
 	doexit = 0;
@@ -209,5 +451,6 @@ int main(int argc, char *argv[]) {
 	/*tidy up */
 	fuse_opt_free_args(&args);
 	if(root)free(root);
+	if(tier_root)free(tier_root);
 	return res;
 }
@@ -0,0 +1,1119 @@
+#define _GNU_SOURCE        /* for the *at() calls */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "userModeFS.h"
+#include "pack.h"
+/*
+Small file packing. Regular files created through passfs start life as an entry
+in an in-memory index instead of a backing inode, their content is appended to
+a single data pack (PACK_DIRNAME/data.<generation>) and every change to an entry
+is appended to an index log (PACK_DIRNAME/index) that is replayed at mount.
+getattr, readdir and read of a packed file are answered from the index and the
+pack without touching the backing directory tree.
+
+While a packed file is open for writing its content is held in memory, it is
+appended to the pack again on flush (close), fsync and the last release. If
+that fails the content stays in memory, still dirty, and the error is returned
+to flush, so a failed close() is reported and a later one can retry.
+A file that grows beyond pack_threshold is spilled: written out as a normal
+backing file, with its owner, mode and times, and dropped from the index,
+after which it is plain passthrough.
+
+Index records carry their length and a checksum. A record that is only partly
+written is cut off again; one damaged by a crash is skipped at replay, which
+picks up again at the next valid record. Every change is logged before the
+in-memory index is updated, so a failed log write leaves both as they were.
+A change is always a single record, a rename (with the file it replaces) or
+the rename of a whole directory included, so it is replayed entirely or not
+at all. For each directory the number of packed files below it (at any depth)
+is kept, so renaming a directory only visits the parts of the tree that hold
+packed files.
+
+Space is reclaimed at mount. After replay the index is written out again as
+one record per live file (to index.new, renamed over index) and, when less
+than half of the data pack is live content, the live content is first copied
+to a data pack of the next generation, which the new index names. Until the
+rename the old index and data pack are untouched, so a crash during either
+step loses nothing. Space freed while mounted is reclaimed at the next mount.
+*/
+
+#define PACK_MAGIC 0x6b636170   /* "pack" */
+
+#define PACK_COMPACT_MIN (1 << 20)   /* dead space in the data pack worth copying the rest for */
+
+/* PACK_MOVE and PACK_MOVETREE hold "from\0to" as their path, PACK_DATA the data pack generation in off */
+enum { PACK_ADD = 1, PACK_DEL = 2, PACK_MOVE = 3, PACK_MOVETREE = 4, PACK_DATA = 5 };
+
+/* index log record, the path (pathlen bytes, no terminator) follows */
+struct pack_rec {
+	uint32_t magic;
+	uint32_t reclen;            /* whole record, path included */
+	uint32_t sum;               /* FNV-1a of the record, taken with sum zero */
+	uint32_t op;
+	uint64_t off, len;
+	uint32_t mode, uid, gid;
+	uint32_t pathlen;
+	int64_t mtime, ctime;
+};
+#define PACK_RECMAX (sizeof(struct pack_rec) + 2 * PATHLEN_MAX)
+
+struct pack_ent {
+	char *path;
+	size_t dirlen;              /* length of the parent directory part of path, "/" is 1 */
+	uint64_t off, len;          /* committed content in the data pack */
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime, ctime, atime;
+	int indexed;                /* visible by name */
+	unsigned int opens;
+	char *buf;                  /* content while being changed or not yet committed */
+	size_t buflen, bufcap;
+	int dirty;
+	int spill_fd;               /* backing file after outgrowing the threshold, -1 if none */
+	struct pack_ent *next, *dir_next;
+};
+
+/* a directory with packed files somewhere below it */
+struct pack_dir {
+	char *path;
+	unsigned long below;
+	struct pack_dir *next;
+};
+
+struct pack_handle {
+	struct pack_ent *e;
+	int flags;
+};
+
+unsigned long pack_threshold;
+
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pack_ent *pack_table[PACK_BUCKETS];   /* by path */
+static struct pack_ent *pack_dirs[PACK_BUCKETS];    /* by parent directory */
+static struct pack_dir *pack_tree[PACK_BUCKETS];    /* by directory path */
+static int pack_tree_lost;                          /* a count could not be kept, renames scan everything */
+static int pack_data_fd, pack_index_fd;
+static uint64_t pack_data_end, pack_index_end;
+static uint64_t pack_gen;                           /* generation of the data pack */
+static unsigned long pack_files, pack_live, pack_spills, pack_skipped;
+
+
+void pack_init() {
+	pack_threshold = 0;
+	pack_data_fd = pack_index_fd = -1;
+	pack_data_end = pack_index_end = 0;
+	pack_gen = 0;
+	pack_files = pack_live = pack_spills = pack_skipped = 0;
+	pack_tree_lost = 0;
+	memset(pack_table, 0, sizeof(pack_table));
+	memset(pack_dirs, 0, sizeof(pack_dirs));
+	memset(pack_tree, 0, sizeof(pack_tree));
+}
+
+static unsigned int pack_hash(const char *s, size_t len) {
+	unsigned int h = 2166136261u;
+	while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % PACK_BUCKETS;
+}
+
+static size_t pack_dirlen(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash == path ? 1 : (size_t)(slash - path);
+}
+
+static struct pack_ent *pack_find(const char *path) {
+	struct pack_ent *e = pack_table[pack_hash(path, strlen(path))];
+	while (e && strcmp(e->path, path) != 0) e = e->next;
+	return e;
+}
+
+static struct pack_dir **pack_tree_find(const char *dir, size_t len) {
+	struct pack_dir **pd = &pack_tree[pack_hash(dir, len)];
+	while (*pd && (strlen((*pd)->path) != len || strncmp((*pd)->path, dir, len) != 0)) pd = &(*pd)->next;
+	return pd;
+}
+
+static unsigned long pack_below(const char *dir) {
+	struct pack_dir *d = *pack_tree_find(dir, strlen(dir));
+	return d ? d->below : 0;
+}
+
+static void pack_count(const char *path, int delta) {/*
+add delta to the packed file count of every directory above path
+*/
+	struct pack_dir **pd, *d;
+	size_t len;
+
+	for (len = 0; path[len]; len++) {
+		if (path[len] != '/') continue;
+		pd = pack_tree_find(path, len ? len : 1);
+		if (!(d = *pd)) {
+			if (delta < 0) continue;
+			if (!(d = calloc(1, sizeof(struct pack_dir))) || !(d->path = strndup(path, len ? len : 1))) {
+				free(d);
+				pack_tree_lost = 1;
+				continue;
+			}
+			*pd = d;
+		}
+		d->below += delta;
+		if (d->below == 0) {
+			*pd = d->next;
+			free(d->path);
+			free(d);
+		}
+	}
+}
+
+static void pack_insert(struct pack_ent *e) {
+	unsigned int h = pack_hash(e->path, strlen(e->path));
+	e->dirlen = pack_dirlen(e->path);
+	e->next = pack_table[h];
+	pack_table[h] = e;
+	h = pack_hash(e->path, e->dirlen);
+	e->dir_next = pack_dirs[h];
+	pack_dirs[h] = e;
+	e->indexed = 1;
+	pack_files++;
+	pack_live += e->len;
+	pack_count(e->path, 1);
+}
+
+static void pack_remove(struct pack_ent *e) {
+	struct pack_ent **pp;
+
+	for (pp = &pack_table[pack_hash(e->path, strlen(e->path))]; *pp != e; pp = &(*pp)->next);
+	*pp = e->next;
+	for (pp = &pack_dirs[pack_hash(e->path, e->dirlen)]; *pp != e; pp = &(*pp)->dir_next);
+	*pp = e->dir_next;
+	e->indexed = 0;
+	pack_files--;
+	pack_live -= e->len;
+	pack_count(e->path, -1);
+}
+
+static void pack_free_buf(struct pack_ent *e) {
+	free(e->buf);
+	e->buf = NULL;
+	e->buflen = e->bufcap = 0;
+	e->dirty = 0;
+}
+
+static void pack_free_unused(struct pack_ent *e) {
+	if (e->indexed || e->opens) return;
+	if (e->spill_fd != -1) close(e->spill_fd);
+	free(e->buf);
+	free(e->path);
+	free(e);
+}
+
+static uint32_t pack_sum(const char *rec, size_t len) {
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = i >= offsetof(struct pack_rec, sum) && i < offsetof(struct pack_rec, sum) + 4 ? 0 : rec[i];
+		h = (h ^ c) * 16777619u;
+	}
+	return h;
+}
+
+static size_t pack_rec(char *rec, int op, const struct pack_ent *e, const char *path, const char *to) {/*
+build the record for e (or none) under path, or moving path to to, in rec (PACK_RECMAX bytes), returns its length or 0
+*/
+	struct pack_rec r;
+	size_t pathlen = strlen(path), tolen = to ? strlen(to) + 1 : 0;
+
+	if (pathlen >= PATHLEN_MAX || tolen > PATHLEN_MAX) return 0;
+	memset(&r, 0, sizeof(r));
+	r.magic = PACK_MAGIC;
+	r.reclen = sizeof(r) + pathlen + tolen;
+	r.op = op;
+	if (e) {
+		r.off = e->off;
+		r.len = e->len;
+		r.mode = e->mode;
+		r.uid = e->uid;
+		r.gid = e->gid;
+		r.mtime = e->mtime;
+		r.ctime = e->ctime;
+	}
+	r.pathlen = pathlen + tolen;
+	memcpy(rec, &r, sizeof(r));
+	memcpy(rec + sizeof(r), path, pathlen);
+	if (to) {
+		rec[sizeof(r) + pathlen] = '\0';
+		memcpy(rec + sizeof(r) + pathlen + 1, to, tolen - 1);
+	}
+	r.sum = pack_sum(rec, r.reclen);
+	memcpy(rec + offsetof(struct pack_rec, sum), &r.sum, sizeof(r.sum));
+	return r.reclen;
+}
+
+static int pack_pwrite(int fd, const char *buf, size_t len, uint64_t off) {/*
+write all of buf at off, returns 0 or -errno
+*/
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, off);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return n == -1 ? -errno : -EIO;
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int pack_append(const char *recs, size_t len) {/*
+append records to the index, a failed write is cut off again, called with the lock held
+*/
+	int res = len ? pack_pwrite(pack_index_fd, recs, len, pack_index_end) : -ENAMETOOLONG;
+
+	if (res) {
+		if (len && ftruncate(pack_index_fd, pack_index_end) == -1) perror("pack index");
+		return res;
+	}
+	pack_index_end += len;
+	return 0;
+}
+
+static int pack_log(int op, const struct pack_ent *e) {
+	char rec[PACK_RECMAX];
+	return pack_append(rec, pack_rec(rec, op, e, e->path, NULL));
+}
+
+static int pack_load_buf(struct pack_ent *e) {/*
+bring the committed content of e into memory, called with the lock held
+*/
+	if (e->buf) return 0;
+	e->bufcap = e->len > 64 ? e->len : 64;
+	if (!(e->buf = malloc(e->bufcap))) return -ENOMEM;
+	e->buflen = e->len;
+	if (e->len && pread(pack_data_fd, e->buf, e->len, e->off) != (ssize_t)e->len) {
+		pack_free_buf(e);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int pack_commit(struct pack_ent *e) {/*
+append changed content to the pack, called with the lock held
+*/
+	uint64_t off = e->off, len = e->len;
+	int res;
+
+	if (!e->dirty || !e->indexed || e->spill_fd != -1) return 0;
+	if ((res = pack_pwrite(pack_data_fd, e->buf, e->buflen, pack_data_end))) return res;
+	e->off = pack_data_end;
+	e->len = e->buflen;
+	if ((res = pack_log(PACK_ADD, e))) {
+		e->off = off;
+		e->len = len;
+		return res;
+	}
+	pack_data_end += e->buflen;
+	pack_live += e->len;
+	pack_live -= len;
+	e->dirty = 0;
+	return 0;
+}
+
+static int pack_spill(struct pack_ent *e) {/*
+turn e into a normal backing file, called with the lock held and the content loaded
+*/
+	char p[PATHLEN_MAX];
+	struct timespec times[2] = { { e->atime, 0 }, { e->mtime, 0 } };
+	int fd, res;
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, e->path);
+	fd = open(p, O_CREAT | O_TRUNC | O_RDWR, e->mode & 07777);
+	if (fd == -1) return -errno;
+	res = pack_pwrite(fd, e->buf, e->buflen, 0);
+	if (fchown(fd, e->uid, e->gid) == -1) { /* not allowed unless we are root, as for files made by mknod */ }
+	if (!res && (fchmod(fd, e->mode & 07777) == -1 || futimens(fd, times) == -1)) res = -errno;
+	if (!res) res = pack_log(PACK_DEL, e);
+	if (res) {
+		close(fd);
+		unlink(p);
+		return res;
+	}
+	pack_remove(e);
+	pack_free_buf(e);
+	e->spill_fd = fd;
+	pack_spills++;
+	return 0;
+}
+
+static int pack_resize(struct pack_ent *e, size_t size) {/*
+make room for size bytes of content, zero filling any gap, called with the lock held
+*/
+	if (size > e->bufcap) {
+		size_t cap = e->bufcap * 2 > size ? e->bufcap * 2 : size;
+		char *buf = realloc(e->buf, cap);
+		if (!buf) return -ENOMEM;
+		e->buf = buf;
+		e->bufcap = cap;
+	}
+	if (size > e->buflen) memset(e->buf + e->buflen, 0, size - e->buflen);
+	return 0;
+}
+
+static void pack_settle(struct pack_ent *e) {/*
+nobody has e open any more, drop what is only needed while it is, called with the lock held
+*/
+	if (!e->dirty || !e->indexed) pack_free_buf(e);   /* unsaved content is kept for another try */
+	if (e->spill_fd != -1) {
+		close(e->spill_fd);
+		e->spill_fd = -1;
+	}
+	pack_free_unused(e);
+}
+
+static int pack_relink(struct pack_ent *e, const char *to) {/*
+give e the name to in memory, called with the lock held
+*/
+	char *path = strdup(to);
+
+	if (!path) return -ENOMEM;
+	pack_remove(e);
+	free(e->path);
+	e->path = path;
+	pack_insert(e);
+	return 0;
+}
+
+static int pack_collect(struct pack_ent ***moved, size_t *n, size_t *cap, struct pack_ent *e) {
+	if (*n == *cap) {
+		struct pack_ent **m = realloc(*moved, (*cap = *cap ? *cap * 2 : 64) * sizeof(*m));
+		if (!m) return -ENOMEM;
+		*moved = m;
+	}
+	(*moved)[(*n)++] = e;
+	return 0;
+}
+
+static int pack_move_tree(const char *from, const char *to, int log) {/*
+move the packed files below the directory from to below to, logging it first if log is set,
+called with the lock held
+*/
+	char path[PATHLEN_MAX], rec[PACK_RECMAX];
+	size_t len = strlen(from), dlen, n = 0, cap = 0, i;
+	struct pack_ent *e, **moved = NULL;
+	struct pack_dir *d;
+	int b, res = 0;
+
+	if (!pack_tree_lost && !pack_below(from)) return 0;
+	for (b = 0; b < PACK_BUCKETS && !res; b++) {
+		if (pack_tree_lost) {
+			/* the counts are not to be trusted, look at every packed file */
+			for (e = pack_table[b]; e && !res; e = e->next) {
+				if (strncmp(e->path, from, len) == 0 && e->path[len] == '/') res = pack_collect(&moved, &n, &cap, e);
+			}
+			continue;
+		}
+		/* the directories holding packed files, then the files in each */
+		for (d = pack_tree[b]; d && !res; d = d->next) {
+			if (strncmp(d->path, from, len) != 0 || (d->path[len] != '\0' && d->path[len] != '/')) continue;
+			dlen = strlen(d->path);
+			for (e = pack_dirs[pack_hash(d->path, dlen)]; e && !res; e = e->dir_next) {
+				if (e->dirlen == dlen && strncmp(e->path, d->path, dlen) == 0) res = pack_collect(&moved, &n, &cap, e);
+			}
+		}
+	}
+	if (!res && n && log) res = pack_append(rec, pack_rec(rec, PACK_MOVETREE, NULL, from, to));
+	for (i = 0; i < n && !res; i++) {
+		snprintf(path, PATHLEN_MAX, "%s%s", to, moved[i]->path + len);
+		pack_relink(moved[i], path);
+	}
+	free(moved);
+	return res;
+}
+
+static void pack_replay(const char *rec) {/*
+apply one checked index record at load
+*/
+	struct pack_rec r;
+	char path[2 * PATHLEN_MAX];
+	const char *to = NULL;
+	struct pack_ent *e, *t;
+
+	memcpy(&r, rec, sizeof(r));
+	memcpy(path, rec + sizeof(r), r.pathlen);
+	path[r.pathlen] = '\0';
+	if (r.op == PACK_MOVE || r.op == PACK_MOVETREE) {
+		if (strlen(path) >= r.pathlen) return;
+		to = path + strlen(path) + 1;
+	}
+	else if (r.pathlen >= PATHLEN_MAX) return;
+	switch (r.op) {
+	case PACK_DATA:
+		pack_gen = r.off;
+		return;
+	case PACK_MOVETREE:
+		pack_move_tree(path, to, 0);
+		return;
+	case PACK_MOVE:
+		if (!(e = pack_find(path))) return;
+		if ((t = pack_find(to))) {
+			pack_remove(t);
+			pack_free_unused(t);
+		}
+		e->ctime = r.ctime;
+		pack_relink(e, to);
+		return;
+	case PACK_DEL:
+		if ((e = pack_find(path))) {
+			pack_remove(e);
+			pack_free_unused(e);
+		}
+		return;
+	case PACK_ADD:
+		break;
+	default:
+		return;
+	}
+	if ((e = pack_find(path))) pack_remove(e);
+	else if ((e = calloc(1, sizeof(struct pack_ent)))) {
+		e->spill_fd = -1;
+		if (!(e->path = strdup(path))) {
+			free(e);
+			return;
+		}
+	}
+	else return;
+	e->off = r.off;
+	e->len = r.len;
+	e->mode = r.mode;
+	e->uid = r.uid;
+	e->gid = r.gid;
+	e->mtime = e->atime = r.mtime;
+	e->ctime = r.ctime;
+	pack_insert(e);
+}
+
+static void pack_data_path(char *p, uint64_t gen) {
+	if (gen) snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME "/data.%llu", root, (unsigned long long)gen);
+	else snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME "/data", root);
+}
+
+static int pack_compact() {/*
+copy the live content to a data pack of the next generation and switch to it, returns 0 or -errno, at load
+*/
+	char p[PATHLEN_MAX], *buf = NULL, *more;
+	size_t cap = 0;
+	uint64_t end = 0;
+	struct pack_ent *e;
+	int fd, b, res = 0;
+
+	pack_data_path(p, pack_gen + 1);
+	if ((fd = open(p, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) return -errno;
+	for (b = 0; b < PACK_BUCKETS && !res; b++) {
+		for (e = pack_table[b]; e && !res; e = e->next) {
+			if (e->len > cap) {
+				if (!(more = realloc(buf, e->len))) {
+					res = -ENOMEM;
+					break;
+				}
+				buf = more;
+				cap = e->len;
+			}
+			if (e->len && pread(pack_data_fd, buf, e->len, e->off) != (ssize_t)e->len) res = -EIO;
+			else res = pack_pwrite(fd, buf, e->len, end);
+			end += e->len;
+		}
+	}
+	free(buf);
+	if (!res && fsync(fd) == -1) res = -errno;
+	if (res) {
+		close(fd);
+		unlink(p);
+		return res;
+	}
+	/* the same walk again to hand out the new offsets */
+	end = 0;
+	for (b = 0; b < PACK_BUCKETS; b++) {
+		for (e = pack_table[b]; e; e = e->next) {
+			e->off = end;
+			end += e->len;
+		}
+	}
+	close(pack_data_fd);
+	pack_data_fd = fd;
+	pack_data_end = end;
+	pack_gen++;
+	return 0;
+}
+
+static int pack_rewrite() {/*
+write the index out again as one record per packed file and make it the index, returns 0 or -errno, at load
+*/
+	char p[PATHLEN_MAX], q[PATHLEN_MAX], buf[65536];
+	struct pack_ent head, *e;
+	size_t len, n;
+	uint64_t end = 0;
+	int fd, dfd, b, res = 0;
+
+	snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME "/index", root);
+	snprintf(q, PATHLEN_MAX, "%s" PACK_DIRNAME "/index.new", root);
+	if ((fd = open(q, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) return -errno;
+	memset(&head, 0, sizeof(head));
+	head.off = pack_gen;
+	len = pack_rec(buf, PACK_DATA, &head, "/", NULL);
+	for (b = 0; b < PACK_BUCKETS && !res; b++) {
+		for (e = pack_table[b]; e && !res; e = e->next) {
+			if (len + PACK_RECMAX > sizeof(buf)) {
+				res = pack_pwrite(fd, buf, len, end);
+				end += len;
+				len = 0;
+			}
+			if (!(n = pack_rec(buf + len, PACK_ADD, e, e->path, NULL))) res = -ENAMETOOLONG;
+			len += n;
+		}
+	}
+	if (!res) res = pack_pwrite(fd, buf, len, end);
+	end += len;
+	if (!res && (fsync(fd) == -1 || rename(q, p) == -1)) res = -errno;
+	if (res) {
+		close(fd);
+		unlink(q);
+		return res;
+	}
+	/* the rename has to be on disk before the old data pack goes */
+	snprintf(q, PATHLEN_MAX, "%s" PACK_DIRNAME, root);
+	if ((dfd = open(q, O_RDONLY | O_DIRECTORY)) != -1) {
+		if (fsync(dfd) == -1) perror(q);
+		close(dfd);
+	}
+	pack_index_fd = fd;
+	pack_index_end = end;
+	return 0;
+}
+
+static void pack_clean() {/*
+remove the data packs of other generations, left by a compaction or by one that was cut short
+*/
+	char p[PATHLEN_MAX], cur[PATHLEN_MAX];
+	struct dirent *de;
+	DIR *dp;
+
+	pack_data_path(cur, pack_gen);
+	snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME, root);
+	if (!(dp = opendir(p))) return;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, "data") != 0 && strncmp(de->d_name, "data.", 5) != 0) continue;
+		snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME "/%s", root, de->d_name);
+		if (strcmp(p, cur) != 0 && unlink(p) == -1) perror(p);
+	}
+	closedir(dp);
+}
+
+int pack_load() {/*
+replay the index, reclaim the space of what it no longer holds and open the pack, returns 0 or -1
+*/
+	char p[PATHLEN_MAX];
+	struct pack_rec r;
+	struct pack_ent *e, *next;
+	struct stat st;
+	uint64_t off = 0;
+	unsigned long lost = 0;
+	char *map = NULL;
+	int fd, b, res;
+
+	snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME, root);
+	if (mkdir(p, 0700) == -1 && errno != EEXIST) {
+		perror(p);
+		return -1;
+	}
+	snprintf(p, PATHLEN_MAX, "%s" PACK_DIRNAME "/index", root);
+	if ((fd = open(p, O_RDONLY | O_CREAT, 0600)) == -1 || fstat(fd, &st) == -1) {
+		perror(p);
+		return -1;
+	}
+	if (st.st_size && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		perror(p);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	while (off + sizeof(r) <= (uint64_t)st.st_size) {
+		memcpy(&r, map + off, sizeof(r));
+		if (r.magic != PACK_MAGIC || r.reclen > st.st_size - off || r.pathlen == 0 || r.pathlen >= 2 * PATHLEN_MAX ||
+		    r.reclen != sizeof(r) + r.pathlen || pack_sum(map + off, r.reclen) != r.sum) {
+			/* damaged, look for the next record */
+			pack_skipped++;
+			off++;
+			continue;
+		}
+		pack_replay(map + off);
+		off += r.reclen;
+	}
+	if (map) munmap(map, st.st_size);
+	if (pack_skipped) fprintf(stderr, "%s: skipped %lu damaged bytes\n", p, pack_skipped);
+
+	pack_data_path(p, pack_gen);
+	if ((pack_data_fd = open(p, O_RDWR | O_CREAT, 0600)) == -1) {
+		perror(p);
+		return -1;
+	}
+	pack_data_end = lseek(pack_data_fd, 0, SEEK_END);
+	/* content the data pack lost in a crash */
+	for (b = 0; b < PACK_BUCKETS; b++) {
+		for (e = pack_table[b]; e; e = next) {
+			next = e->next;
+			if (e->off + e->len <= pack_data_end) continue;
+			pack_remove(e);
+			pack_free_unused(e);
+			lost++;
+		}
+	}
+	if (lost) fprintf(stderr, "%s: dropped %lu files beyond its end\n", p, lost);
+	if (pack_data_end > 2 * pack_live + PACK_COMPACT_MIN && (res = pack_compact())) {
+		fprintf(stderr, "%s: not compacted: %s\n", p, strerror(-res));
+	}
+	if ((res = pack_rewrite())) {
+		fprintf(stderr, "%s" PACK_DIRNAME "/index: %s\n", root, strerror(-res));
+		return -1;
+	}
+	pack_clean();
+	return 0;
+}
+
+int pack_reserved(const char *path) {/*
+is path the pack directory or inside it
+*/
+	size_t len = strlen(PACK_DIRNAME);
+	return strncmp(path, PACK_DIRNAME, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+int pack_exists(const char *path) {
+	pthread_mutex_lock(&pack_lock);
+	int res = pack_find(path) != NULL;
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_getattr(const char *path, struct stat *stbuf) {/*
+returns 0 with stbuf filled in if path is packed, otherwise -ENOENT
+*/
+	struct pack_ent *e;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(path);
+	if (!e) {
+		pthread_mutex_unlock(&pack_lock);
+		return -ENOENT;
+	}
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = pack_hash(path, strlen(path)) + 1;
+	stbuf->st_mode = S_IFREG | (e->mode & 07777);
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = e->uid;
+	stbuf->st_gid = e->gid;
+	stbuf->st_size = e->buf ? e->buflen : e->len;
+	stbuf->st_blksize = 4096;
+	stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+	stbuf->st_atime = e->atime;
+	stbuf->st_mtime = e->mtime;
+	stbuf->st_ctime = e->ctime;
+	pthread_mutex_unlock(&pack_lock);
+	return 0;
+}
+
+int pack_access(const char *path, int mask) {
+	struct pack_ent *e;
+	int res = 0;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(path);
+	if (!e) res = -ENOENT;
+	else if ((mask & X_OK) && !(e->mode & 0111)) res = -EACCES;
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+static int pack_parent(const char *path) {/*
+is the parent of path a directory in the backing tree, returns 0 or -errno
+*/
+	char p[PATHLEN_MAX];
+	struct stat st;
+
+	snprintf(p, PATHLEN_MAX, "%s%.*s", root, (int)pack_dirlen(path), path);
+	if (lstat(p, &st) == -1) return -errno;
+	return S_ISDIR(st.st_mode) ? 0 : -ENOTDIR;
+}
+
+int pack_create(const char *path, mode_t mode) {/*
+create an empty packed file, returns 0 or -errno
+*/
+	char p[PATHLEN_MAX];
+	struct stat st;
+	struct pack_ent *e;
+	int res;
+
+	if ((res = pack_parent(path))) return res;
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	if (lstat(p, &st) == 0) return -EEXIST;
+	if (errno != ENOENT) return -errno;
+
+	if (!(e = calloc(1, sizeof(struct pack_ent)))) return -ENOMEM;
+	if (!(e->path = strdup(path))) {
+		free(e);
+		return -ENOMEM;
+	}
+	e->spill_fd = -1;
+	e->mode = mode & 07777;
+	e->uid = getuid();
+	e->gid = getgid();
+	e->mtime = e->ctime = e->atime = time(NULL);
+
+	pthread_mutex_lock(&pack_lock);
+	res = pack_find(path) ? -EEXIST : pack_log(PACK_ADD, e);
+	if (!res) pack_insert(e);
+	pthread_mutex_unlock(&pack_lock);
+	if (res) {
+		free(e->path);
+		free(e);
+	}
+	return res;
+}
+
+int pack_open(const char *path, int flags, uint64_t *fh) {/*
+open a packed file, returns 0 with the handle in fh or -ENOENT if path is not packed
+*/
+	struct pack_handle *h = malloc(sizeof(struct pack_handle));
+	struct pack_ent *e;
+
+	if (!h) return -ENOMEM;
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(path);
+	if (!e) {
+		pthread_mutex_unlock(&pack_lock);
+		free(h);
+		return -ENOENT;
+	}
+	if (flags & O_TRUNC) {
+		int res = pack_load_buf(e);
+		if (res) {
+			pthread_mutex_unlock(&pack_lock);
+			free(h);
+			return res;
+		}
+		e->buflen = 0;
+		e->dirty = 1;
+		e->mtime = e->ctime = time(NULL);
+	}
+	e->opens++;
+	pthread_mutex_unlock(&pack_lock);
+	h->e = e;
+	h->flags = flags;
+	*fh = (uint64_t)(uintptr_t)h | PACK_FH_TAG;
+	return 0;
+}
+
+static struct pack_handle *pack_handle(uint64_t fh) {
+	return (struct pack_handle *)(uintptr_t)(fh & ~PACK_FH_TAG);
+}
+
+int pack_read(uint64_t fh, char *buf, size_t size, off_t offset) {
+	struct pack_ent *e = pack_handle(fh)->e;
+	int fd;
+	ssize_t res;
+
+	pthread_mutex_lock(&pack_lock);
+	e->atime = time(NULL);
+	if (e->spill_fd != -1) {
+		fd = e->spill_fd;
+		pthread_mutex_unlock(&pack_lock);
+		res = pread(fd, buf, size, offset);
+		return res == -1 ? -errno : res;
+	}
+	if (e->buf) {
+		if ((size_t)offset >= e->buflen) size = 0;
+		else if (size > e->buflen - offset) size = e->buflen - offset;
+		memcpy(buf, e->buf + offset, size);
+		pthread_mutex_unlock(&pack_lock);
+		return size;
+	}
+	/* committed content is never overwritten in the pack so it can be read unlocked */
+	uint64_t off = e->off, len = e->len;
+	pthread_mutex_unlock(&pack_lock);
+	if ((uint64_t)offset >= len) return 0;
+	if (size > len - offset) size = len - offset;
+	res = pread(pack_data_fd, buf, size, off + offset);
+	return res == -1 ? -errno : res;
+}
+
+int pack_write(uint64_t fh, const char *buf, size_t size, off_t offset) {
+	struct pack_handle *h = pack_handle(fh);
+	struct pack_ent *e = h->e;
+	int res, fd;
+
+	pthread_mutex_lock(&pack_lock);
+	res = pack_load_buf(e);
+	if (!res && e->spill_fd == -1) {
+		if (h->flags & O_APPEND) offset = e->buflen;
+		/* an unlinked file has no name to spill to, it stays in memory */
+		if (offset + size > pack_threshold && e->indexed) res = pack_spill(e);
+	}
+	if (res) {
+		pthread_mutex_unlock(&pack_lock);
+		return res;
+	}
+	if (e->spill_fd != -1) {
+		fd = e->spill_fd;
+		pthread_mutex_unlock(&pack_lock);
+		res = pwrite(fd, buf, size, offset);
+		return res == -1 ? -errno : res;
+	}
+	res = pack_resize(e, offset + size);
+	if (!res) {
+		memcpy(e->buf + offset, buf, size);
+		if (offset + size > e->buflen) e->buflen = offset + size;
+		e->dirty = 1;
+		e->mtime = e->ctime = time(NULL);
+		res = size;
+	}
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_flush(uint64_t fh) {/*
+commit what has been written so that close() sees any error
+*/
+	struct pack_ent *e = pack_handle(fh)->e;
+
+	pthread_mutex_lock(&pack_lock);
+	int res = pack_commit(e);
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_fsync(uint64_t fh) {
+	struct pack_ent *e = pack_handle(fh)->e;
+	int res;
+
+	pthread_mutex_lock(&pack_lock);
+	res = pack_commit(e);
+	int fd = e->spill_fd;
+	pthread_mutex_unlock(&pack_lock);
+	if (res) return res;
+	if (fd != -1) return fsync(fd) == -1 ? -errno : 0;
+	if (fdatasync(pack_data_fd) == -1 || fdatasync(pack_index_fd) == -1) return -errno;
+	return 0;
+}
+
+int pack_release(uint64_t fh) {
+	struct pack_handle *h = pack_handle(fh);
+	struct pack_ent *e = h->e;
+	int res = 0;
+
+	pthread_mutex_lock(&pack_lock);
+	if (--e->opens == 0) {
+		res = pack_commit(e);
+		pack_settle(e);
+	}
+	pthread_mutex_unlock(&pack_lock);
+	free(h);
+	return res;
+}
+
+int pack_truncate(const char *path, off_t size) {/*
+returns 0, -errno or -ENOENT if path is not packed
+*/
+	struct pack_ent *e;
+	int res;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(path);
+	if (!e) {
+		pthread_mutex_unlock(&pack_lock);
+		return -ENOENT;
+	}
+	res = pack_load_buf(e);
+	if (!res && (uint64_t)size > pack_threshold) {
+		res = pack_spill(e);
+		if (!res && ftruncate(e->spill_fd, size) == -1) res = -errno;
+	}
+	else if (!res) {
+		res = pack_resize(e, size);
+		if (!res) {
+			e->buflen = size;
+			e->dirty = 1;
+			e->mtime = e->ctime = time(NULL);
+		}
+	}
+	if (e->opens == 0) {
+		/* nobody has it open, settle it now */
+		if (!res) res = pack_commit(e);
+		pack_settle(e);
+	}
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_unlink(const char *path) {/*
+returns 0, -errno or -ENOENT if path is not packed
+*/
+	struct pack_ent *e;
+	int res;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(path);
+	res = e ? pack_log(PACK_DEL, e) : -ENOENT;
+	if (!res) {
+		pack_remove(e);
+		pack_free_unused(e);
+	}
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+static int pack_move(struct pack_ent *e, const char *to, struct pack_ent *victim) {/*
+give e a new name, replacing victim if there is one, called with the lock held
+*/
+	char rec[PACK_RECMAX];
+	int res;
+
+	/* one record for both, so that replay never sees the victim gone without e moved */
+	if ((res = pack_append(rec, pack_rec(rec, PACK_MOVE, e, e->path, to)))) return res;
+	if (victim) {
+		pack_remove(victim);
+		pack_free_unused(victim);
+	}
+	return pack_relink(e, to);
+}
+
+int pack_rename(const char *from, const char *to) {/*
+rename a packed file over whatever is at to, returns 0, -errno or -ENOENT if from is not packed
+*/
+	char p[PATHLEN_MAX];
+	struct stat st;
+	struct pack_ent *e, *t;
+	int res, backing;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(from);
+	if (!e) {
+		pthread_mutex_unlock(&pack_lock);
+		return -ENOENT;
+	}
+	if (strcmp(from, to) == 0) {
+		pthread_mutex_unlock(&pack_lock);
+		return 0;
+	}
+	if ((res = pack_parent(to))) {
+		pthread_mutex_unlock(&pack_lock);
+		return res;
+	}
+	snprintf(p, PATHLEN_MAX, "%s%s", root, to);
+	backing = lstat(p, &st) == 0;
+	if (backing && S_ISDIR(st.st_mode)) {
+		pthread_mutex_unlock(&pack_lock);
+		return -EISDIR;
+	}
+	t = pack_find(to);
+	time_t ctime = e->ctime;
+	e->ctime = time(NULL);
+	if ((res = pack_move(e, to, t))) e->ctime = ctime;
+	/* the backing file is replaced only once the rename is logged */
+	else if (backing && unlink(p) == -1) perror(p);
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_rename_tree(const char *from, const char *to) {/*
+follow a rename of the backing directory from to to with the packed files inside it, returns 0 or -errno
+*/
+	pthread_mutex_lock(&pack_lock);
+	int res = pack_move_tree(from, to, 1);
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_has_children(const char *dir) {
+	size_t len = strlen(dir);
+	struct pack_ent *e;
+
+	pthread_mutex_lock(&pack_lock);
+	for (e = pack_dirs[pack_hash(dir, len)]; e; e = e->dir_next) {
+		if (e->dirlen == len && strncmp(e->path, dir, len) == 0) break;
+	}
+	pthread_mutex_unlock(&pack_lock);
+	return e != NULL;
+}
+
+static int pack_setattr(const char *path, const mode_t *mode, const uid_t *uid, const gid_t *gid, const time_t *atime, const time_t *mtime) {
+	struct pack_ent *e, old;
+	int res;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_find(path);
+	if (!e) {
+		pthread_mutex_unlock(&pack_lock);
+		return -ENOENT;
+	}
+	old = *e;
+	if (mode) e->mode = *mode & 07777;
+	if (uid && *uid != (uid_t)-1) e->uid = *uid;
+	if (gid && *gid != (gid_t)-1) e->gid = *gid;
+	if (atime) e->atime = *atime;
+	if (mtime) e->mtime = *mtime;
+	e->ctime = time(NULL);
+	if ((res = pack_log(PACK_ADD, e))) {
+		e->mode = old.mode;
+		e->uid = old.uid;
+		e->gid = old.gid;
+		e->atime = old.atime;
+		e->mtime = old.mtime;
+		e->ctime = old.ctime;
+	}
+	pthread_mutex_unlock(&pack_lock);
+	return res;
+}
+
+int pack_chmod(const char *path, mode_t mode) {
+	return pack_setattr(path, &mode, NULL, NULL, NULL, NULL);
+}
+
+int pack_chown(const char *path, uid_t uid, gid_t gid) {
+	return pack_setattr(path, NULL, &uid, &gid, NULL, NULL);
+}
+
+int pack_utime(const char *path, time_t atime, time_t mtime) {
+	return pack_setattr(path, NULL, NULL, NULL, &atime, &mtime);
+}
+
+void pack_readdir(const char *dir, void *buf, int (*filler)(void *, const char *, const struct stat *, off_t)) {/*
+add the packed files in dir to a directory listing
+*/
+	size_t len = strlen(dir);
+	struct pack_ent *e;
+
+	pthread_mutex_lock(&pack_lock);
+	for (e = pack_dirs[pack_hash(dir, len)]; e; e = e->dir_next) {
+		if (e->dirlen != len || strncmp(e->path, dir, len) != 0) continue;
+		if (filler(buf, e->path + (len == 1 ? 1 : len + 1), NULL, 0)) break;
+	}
+	pthread_mutex_unlock(&pack_lock);
+}
+
+void pack_sprint(char *s) {
+	if (!pack_threshold) return;
+
+	sprintf(s, "Packed files: %lu holding %lu bytes, pack size %llu bytes (generation %llu), spilled to normal files: %lu\n",
+		pack_files, pack_live, (unsigned long long)pack_data_end, (unsigned long long)pack_gen, pack_spills);
+}
@@ -0,0 +1,42 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+#define PACK_DIRNAME "/.passfs-pack"    /* under root, holds the index and the data pack */
+#define PACK_BUCKETS 65536
+#define PACK_FH_TAG (1ULL << 63)        /* marks a fuse_file_info fh as a packed file handle */
+
+
+extern unsigned long pack_threshold;    /* files up to this size are packed, 0 = packing off */
+
+void pack_init();
+int pack_load();
+int pack_reserved(const char *path);
+int pack_exists(const char *path);
+int pack_getattr(const char *path, struct stat *stbuf);
+int pack_access(const char *path, int mask);
+int pack_create(const char *path, mode_t mode);
+int pack_open(const char *path, int flags, uint64_t *fh);
+#define pack_is_fh(fh) (((fh) & PACK_FH_TAG) != 0)
+int pack_read(uint64_t fh, char *buf, size_t size, off_t offset);
+int pack_write(uint64_t fh, const char *buf, size_t size, off_t offset);
+int pack_flush(uint64_t fh);
+int pack_fsync(uint64_t fh);
+int pack_release(uint64_t fh);
+int pack_truncate(const char *path, off_t size);
+int pack_unlink(const char *path);
+int pack_rename(const char *from, const char *to);
+int pack_rename_tree(const char *from, const char *to);
+int pack_has_children(const char *dir);
+int pack_chmod(const char *path, mode_t mode);
+int pack_chown(const char *path, uid_t uid, gid_t gid);
+int pack_utime(const char *path, time_t atime, time_t mtime);
+void pack_readdir(const char *dir, void *buf, int (*filler)(void *, const char *, const struct stat *, off_t));
+void pack_sprint(char *s);
+
+
+#endif
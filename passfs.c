@@ -13,10 +13,16 @@ This is offered under a BSD-style license. This means you can use the code for w
 */
 #include "fsname.h"
 #ifdef linux
-	/* For pread()/pwrite() */
-	#define _XOPEN_SOURCE 500
+	/* For pread()/pwrite() and the *at() calls */
+	#ifndef _GNU_SOURCE
+	#define _GNU_SOURCE
+	#endif
 #endif
 
+#ifndef FUSE_USE_VERSION
+	/* 26 is needed for the init callback */
+	#define FUSE_USE_VERSION 26
+#endif
 #include <fuse.h>
 
 #include <stdarg.h>
@@ -28,6 +34,8 @@ This is offered under a BSD-style license. This means you can use the code for w
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/statvfs.h>
 
 #ifdef HAVE_SETXATTR
@@ -42,9 +50,57 @@ This is offered under a BSD-style license. This means you can use the code for w
 #include "userModeFS.h"
 
 #include "stats.h"
+#include "qos.h"
+#include "dircache.h"
+#include "fsyncq.h"
+#include "trace.h"
+#include "ctl.h"
+#include "tier.h"
+#include "conn.h"
+#include "fdcache.h"
+#include "sparse.h"
+#include "heat.h"
+#include "pack.h"
+#include "watch.h"
+#include "compress.h"
 #include "debug.h"
 int monitor=0;
 FILE *monitor_file=NULL;
+int readdir_method2=0;
+
+/* the dirref/name pair handed to the *at() calls for path, either from the
+   directory cache or AT_FDCWD with root+path built in p */
+/* the handle of an open virtual file, fi->fh holds its address with VFILE_TAG set so that
+it stays what it was opened as, whatever the settings are changed to while it is open */
+#define VFILE_TAG (1ULL << 62)
+enum { VFILE_STATS = 1, VFILE_CONTROL, VFILE_HEAT };
+struct vfile {
+	int kind;
+	void *data;                 /* the control handle or the heat map dump */
+};
+
+static struct vfile *vfile_of(uint64_t fh) {
+	return (fh & VFILE_TAG) && !pack_is_fh(fh) ? (struct vfile *)(uintptr_t)(fh & ~VFILE_TAG) : NULL;
+}
+
+static int vfile_open(struct fuse_file_info *fi, int kind, void *data) {
+	struct vfile *v = malloc(sizeof(struct vfile));
+	if (!v) return -ENOMEM;
+	v->kind = kind;
+	v->data = data;
+	fi->direct_io = 1;
+	fi->fh = (uint64_t)(uintptr_t)v | VFILE_TAG;
+	return 0;
+}
+
+static int at_path(const char *path, char *p, struct dirref *d, const char **name) {
+	if (dircache_size) return dircache_lookup(path, d, name);
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	d->fd = AT_FDCWD;
+	d->ent = NULL;
+	*name = p;
+	return 0;
+}
 
 
 static void mprintf(const char *format,...) {
@@ -67,14 +123,28 @@ int monitorInit(const char *file)
 	}
 	return 0;
 }
+int monitorSet(int level)
+{/* change the monitor level at run time, file output (1) needs a file given at startup */
+	if(level<0 || level>3 || ((level&1) && !monitor_file))return 1;
+	monitor=level;
+	return 0;
+}
 static int userModeFS_access(const char *path, int mask) {
 	DBG("access\n");
 
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("access %s,mask=%x",path,mask);
-	int res = access(p, mask);
+	int res;
+	if (pack_threshold && (res = pack_access(path, mask)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	res = at_path(path, p, &d, &name);
+	if (res == 0) res = faccessat(d.fd, name, mask, 0);
+	dircache_put(&d);
 	if (res == -1) {
 		if(monitor)mprintf(" res=%x\n",errno);
 		return -errno;
@@ -88,9 +158,17 @@ static int userModeFS_chmod(const char *path, mode_t mode) {
 
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("chmod %s,mode=%x",path,mode);
-	int res = chmod(p, mode);
+	int res;
+	if (pack_threshold && (res = pack_chmod(path, mode)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	res = at_path(path, p, &d, &name);
+	if (res == 0) res = fchmodat(d.fd, name, mode, 0);
+	dircache_put(&d);
 	if (res == -1) {
 		if(monitor)mprintf(" res=%x\n",errno);
 		return -errno;
@@ -103,9 +181,17 @@ static int userModeFS_chown(const char *path, uid_t uid, gid_t gid) {
 	DBG("chown\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("chown %s,uid=%x,gid=%x",path,uid,gid);
-	int res = lchown(p, uid, gid);
+	int res;
+	if (pack_threshold && (res = pack_chown(path, uid, gid)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	res = at_path(path, p, &d, &name);
+	if (res == 0) res = fchownat(d.fd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+	dircache_put(&d);
 	if (res == -1) {
 			if(monitor)mprintf(" res=%x\n",errno);
 			return -errno;
@@ -118,7 +204,9 @@ static int userModeFS_chown(const char *path, uid_t uid, gid_t gid) {
 static int userModeFS_flush(const char *path, struct fuse_file_info *fi) {
 	DBG("flush\n");
 
-	if (stats_enabled && strcmp(path, STATS_FILENAME) == 0) return 0;
+	struct vfile *v = vfile_of(fi->fh);
+	if (v) return v->kind == VFILE_CONTROL ? ctl_flush(v->data) : 0;
+	if (pack_is_fh(fi->fh)) return pack_flush(fi->fh);
 
 	int fd = dup(fi->fh);
 	if(monitor)mprintf("flush %s",path);
@@ -144,11 +232,18 @@ static int userModeFS_flush(const char *path, struct fuse_file_info *fi) {
 static int userModeFS_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
 	DBG("fsync\n");
 
-	if (stats_enabled && strcmp(path, STATS_FILENAME) == 0) return 0;
+	if (vfile_of(fi->fh)) return 0;
 
 	int res;
 	if(monitor)mprintf("fsync %s, isdata",path,isdatasync);
-	if (isdatasync) {
+	if (pack_is_fh(fi->fh)) {
+		res = pack_fsync(fi->fh);
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	if (fsyncq_window) {
+		res = fsyncq_sync(fi->fh, isdatasync);
+	} else if (isdatasync) {
 		res = fdatasync(fi->fh);
 	} else {
 		res = fsync(fi->fh);
@@ -172,11 +267,45 @@ static int userModeFS_getattr(const char *path, struct stat *stbuf) {
 		stbuf->st_size = STATS_SIZE;
 		return 0;
 	}
+	if (ctl_enabled && strcmp(path, CONTROL_FILENAME) == 0) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+		stbuf->st_uid = getuid();
+		stbuf->st_gid = getgid();
+		stbuf->st_size = CONTROL_SIZE;
+		return 0;
+	}
+	if (heat_enabled && strcmp(path, HEATMAP_FILENAME) == 0) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("getattr %s",path);
-	int res = lstat(p, stbuf);
+	int res;
+	if (pack_threshold && pack_reserved(path)) {
+		/* the pack itself is not part of the filesystem */
+		if(monitor)mprintf(" res=%x\n",ENOENT);
+		return -ENOENT;
+	}
+	if (compress_enabled && compress_reserved(path)) {
+		/* so is the compression index */
+		if(monitor)mprintf(" res=%x\n",ENOENT);
+		return -ENOENT;
+	}
+	if (pack_threshold && (res = pack_getattr(path, stbuf)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	res = at_path(path, p, &d, &name);
+	if (res == 0) res = fstatat(d.fd, name, stbuf, AT_SYMLINK_NOFOLLOW);
+	if (res == 0 && compress_enabled) compress_stat(stbuf);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -192,10 +321,29 @@ static int userModeFS_link(const char *from, const char *to) {
 
 
 	char t[PATHLEN_MAX],p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, from);
-	snprintf(t, PATHLEN_MAX, "%s%s", root, to);
+	struct dirref df, dt;
+	const char *fname, *tname;
 	if(monitor)mprintf("link from:%s, to:%s",from,to);
-	int res = link(p, t);
+	if (pack_threshold && (pack_exists(from) || pack_exists(to))) {
+		/* a packed file has no inode to give a second name */
+		int res = pack_exists(to) ? EEXIST : EPERM;
+		if(monitor)mprintf(" res=%x\n",res);
+		return -res;
+	}
+	struct stat st;
+	int res = 0;
+	if (compress_enabled && (res = compress_hold(from, &st)) != 0) {
+		/* only plain files get a second link */
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	dt.ent = NULL;
+	res = at_path(from, p, &df, &fname);
+	if (res == 0) res = at_path(to, t, &dt, &tname);
+	if (res == 0) res = linkat(df.fd, fname, dt.fd, tname, 0);
+	dircache_put(&df);
+	dircache_put(&dt);
+	if (compress_enabled) compress_unhold(&st);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -210,10 +358,17 @@ static int userModeFS_mkdir(const char *path, mode_t mode) {
 
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 
 	if(monitor)mprintf("make dir: %s,mode=%x",path,mode);
-	int res = mkdir(p, mode);
+	if (pack_threshold && pack_exists(path)) {
+		if(monitor)mprintf(" res=%x\n",EEXIST);
+		return -EEXIST;
+	}
+	int res = at_path(path, p, &d, &name);
+	if (res == 0) res = mkdirat(d.fd, name, mode);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -227,14 +382,29 @@ static int userModeFS_mknod(const char *path, mode_t mode, dev_t rdev) {
 	DBG("mknod\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("make node: %s, mode=%x, dev=%x",path,mode,rdev);
+	int res;
+	if (pack_threshold && S_ISREG(mode)) {
+		/* new regular files start out packed */
+		res = pack_create(path, mode);
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	if (pack_threshold && pack_exists(path)) {
+		if(monitor)mprintf(" res=%x\n",EEXIST);
+		return -EEXIST;
+	}
+	res = at_path(path, p, &d, &name);
     #ifdef __APPLE__
     #warning "Substituting creat for mknod - limited functionality"
-    int res = creat(p, mode);
+	if (res == 0) res = openat(d.fd, name, O_CREAT | O_WRONLY | O_TRUNC, mode);
+	if (res >= 0) res = close(res);
     #else
-	int res = mknod(p, mode, rdev);
+	if (res == 0) res = mknodat(d.fd, name, mode, rdev);
     #endif
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -247,28 +417,66 @@ static int userModeFS_mknod(const char *path, mode_t mode, dev_t rdev) {
 static int userModeFS_open(const char *path, struct fuse_file_info *fi) {
 	DBG("open\n");
 
+	int res;
 	if(monitor)mprintf("open: %s,flags=%x,",path,fi->flags);
 	if (stats_enabled && strcmp(path, STATS_FILENAME) == 0) {
-		if ((fi->flags & 3) == O_RDONLY) {
-			fi->direct_io = 1;
+		res = (fi->flags & 3) == O_RDONLY ? vfile_open(fi, VFILE_STATS, NULL) : -EACCES;
+		if (res) {
+			if(monitor)mprintf(" res=%x\n",-res);
+			return res;
 		}
-		else {
-			if(monitor)mprintf(" res=%x\n",EACCES);
-			return -EACCES;
+	}
+	else if (ctl_enabled && strcmp(path, CONTROL_FILENAME) == 0) {
+		void *h = NULL;
+		if ((fi->flags & 3) != O_RDONLY && !ctl_allowed()) res = -EACCES;
+		else if ((fi->flags & 3) != O_RDONLY && !(h = ctl_open())) res = -ENOMEM;
+		else if ((res = vfile_open(fi, VFILE_CONTROL, h))) free(h);
+		if (res) {
+			if(monitor)mprintf(" res=%x\n",-res);
+			return res;
+		}
+	}
+	else if (heat_enabled && strcmp(path, HEATMAP_FILENAME) == 0) {
+		/* the dump is taken at open so that it is consistent across reads */
+		char *dump = (fi->flags & 3) == O_RDONLY ? heat_dump() : NULL;
+		res = !dump ? (fi->flags & 3) == O_RDONLY ? -ENOMEM : -EACCES : vfile_open(fi, VFILE_HEAT, dump);
+		if (res) {
+			free(dump);
+			if(monitor)mprintf(" res=%x\n",-res);
+			return res;
 		}
 	}
+	else if (pack_threshold && (res = pack_open(path, fi->flags, &fi->fh)) != -ENOENT) {
+		if (res) {
+			if(monitor)mprintf(" res=%x\n",-res);
+			return res;
+		}
+		fi->direct_io = !conn_page_cache;
+	}
 	else {
 		char p[PATHLEN_MAX];
-		snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+		struct dirref d;
+		const char *name;
 
-		int fd = open(p, fi->flags);
+		if (compress_enabled && (res = compress_prepare(path, fi->flags)) != 0) {
+			if(monitor)mprintf(" res=%x\n",-res);
+			return res;
+		}
+		int fd = tier_root ? tier_open(path, fi->flags) : -1;
 		if (fd == -1) {
-			int res=errno;
+			fd = at_path(path, p, &d, &name);
+			if (fd == 0) fd = fdcache_max ? fdcache_open(d.fd, name, fi->flags) : openat(d.fd, name, fi->flags);
+			dircache_put(&d);
+		}
+		if (fd != -1 && compress_enabled) fd = compress_opened(path, fd, fi->flags);
+		if (fd != -1 && tier_root && (fi->flags & 3) != O_RDONLY) tier_writer(fd, 1);
+		if (fd == -1) {
+			res=errno;
 			if(monitor)mprintf(" res=%x\n",res);
 			return -res;
 		}
 		else {
-			fi->direct_io = 1;
+			fi->direct_io = !conn_page_cache;
 			fi->fh = (unsigned long)fd;
 		}
 	}
@@ -279,9 +487,34 @@ static int userModeFS_open(const char *path, struct fuse_file_info *fi) {
 static int userModeFS_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
 	DBG("read\n");
 
-	if (stats_enabled && strcmp(path, STATS_FILENAME) == 0) {
+	struct vfile *v = vfile_of(fi->fh);
+	if (v && v->kind == VFILE_STATS) {
 		char out[STATS_SIZE] = "";
 		stats_sprint(out);
+		qos_sprint(out+strlen(out));
+		dircache_sprint(out+strlen(out));
+		fsyncq_sprint(out+strlen(out));
+		tier_sprint(out+strlen(out));
+		conn_sprint(out+strlen(out));
+		fdcache_sprint(out+strlen(out));
+		sparse_sprint(out+strlen(out));
+		pack_sprint(out+strlen(out));
+		watch_sprint(out+strlen(out));
+		compress_sprint(out+strlen(out));
+		trace_sprint(out+strlen(out));
+
+		int s = size;
+		if (offset < strlen(out)) {
+			if (s > strlen(out)-offset) s = strlen(out)-offset;
+			memcpy(buf, out+offset, s);
+		} else {
+			s = 0;
+		}
+		return s;
+	}
+	if (v && v->kind == VFILE_CONTROL) {
+		char out[CONTROL_SIZE] = "";
+		ctl_sprint(out);
 
 		int s = size;
 		if (offset < strlen(out)) {
@@ -292,11 +525,31 @@ static int userModeFS_read(const char *path, char *buf, size_t size, off_t offse
 		}
 		return s;
 	}
+	if (v) {
+		const char *dump = v->data;
+		size_t len = strlen(dump);
+
+		if (offset >= len) return 0;
+		if (size > len-offset) size = len-offset;
+		memcpy(buf, dump+offset, size);
+		return size;
+	}
+
+	qos_admit(size);
 
-	int res = pread(fi->fh, buf, size, offset);
-	if (res == -1) return -errno;
+	int res;
+	if (pack_is_fh(fi->fh)) {
+		res = pack_read(fi->fh, buf, size, offset);
+		if (res < 0) return res;
+	}
+	else {
+		int fd = tier_root ? tier_fd(fi->fh) : (int)fi->fh;
+		res = compress_enabled ? compress_pread(fd, buf, size, offset) : sparse_enabled ? sparse_pread(fd, buf, size, offset) : pread(fd, buf, size, offset);
+		if (res == -1) return -errno;
+	}
 
 	if (stats_enabled) stats_add_read(size);
+	if (heat_enabled) heat_note(path, offset, res, 0);
 
 	return res;
 }
@@ -307,12 +560,20 @@ static int userModeFS_readdirMethod1(const char *path, void *buf, fuse_fill_dir_
 	DBG("readdir\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("readdir1 %s",path);
-	DIR *dp = opendir(p);
+	DIR *dp = NULL;
+	if (at_path(path, p, &d, &name) == 0) {
+		int fd = openat(d.fd, name, O_RDONLY | O_DIRECTORY);
+		if (fd != -1 && !(dp = fdopendir(fd))) close(fd);
+	}
+	dircache_put(&d);
 	if (dp){
 		struct dirent *de;
 		while ((de = readdir(dp)) != NULL) {
+			if (pack_threshold && strcmp(path, "/") == 0 && strcmp(de->d_name, PACK_DIRNAME+1) == 0) continue;
+			if (compress_enabled && strcmp(path, "/") == 0 && strcmp(de->d_name, COMPRESS_DIRNAME+1) == 0) continue;
 			if (filler(buf, de->d_name, NULL, 0)) break;
 		}
 
@@ -322,6 +583,13 @@ static int userModeFS_readdirMethod1(const char *path, void *buf, fuse_fill_dir_
 	if (stats_enabled && strcmp(path, "/") == 0) {
 		filler(buf, "stats", NULL, 0);
 	}
+	if (ctl_enabled && strcmp(path, "/") == 0) {
+		filler(buf, "control", NULL, 0);
+	}
+	if (heat_enabled && strcmp(path, "/") == 0) {
+		filler(buf, "heatmap", NULL, 0);
+	}
+	if (pack_threshold) pack_readdir(path, buf, filler);
 	if(monitor)mprintf(" res=OK\n");
 	return 0;
 }
@@ -330,13 +598,21 @@ static int userModeFS_readdirMethod2(const char *path, void *buf, fuse_fill_dir_
 	DBG("readdir\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("readdir2 %s",path);
-	DIR *dp = opendir(p);
+	DIR *dp = NULL;
+	if (at_path(path, p, &d, &name) == 0) {
+		int fd = openat(d.fd, name, O_RDONLY | O_DIRECTORY);
+		if (fd != -1 && !(dp = fdopendir(fd))) close(fd);
+	}
+	dircache_put(&d);
 	if (dp){
 		struct dirent *de;
 		if(offset)seekdir(dp,offset);
 		while ((de = readdir(dp)) != NULL) {
+			if (pack_threshold && strcmp(path, "/") == 0 && strcmp(de->d_name, PACK_DIRNAME+1) == 0) continue;
+			if (compress_enabled && strcmp(path, "/") == 0 && strcmp(de->d_name, COMPRESS_DIRNAME+1) == 0) continue;
 			if (filler(buf, de->d_name, NULL, telldir(dp))) break;
 		}
 		closedir(dp);
@@ -344,6 +620,13 @@ static int userModeFS_readdirMethod2(const char *path, void *buf, fuse_fill_dir_
 	if (stats_enabled && strcmp(path, "/") == 0) {
 		filler(buf, "stats", NULL, 0);
 	}
+	if (ctl_enabled && strcmp(path, "/") == 0) {
+		filler(buf, "control", NULL, 0);
+	}
+	if (heat_enabled && strcmp(path, "/") == 0) {
+		filler(buf, "heatmap", NULL, 0);
+	}
+	if (pack_threshold) pack_readdir(path, buf, filler);
 	if(monitor)mprintf(" res=OK\n");
 	return 0;
 }
@@ -351,9 +634,12 @@ static int userModeFS_readlink(const char *path, char *buf, size_t size) {
 	DBG("readlink\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("readlink: %s",path);
-	int res = readlink(p, buf, size - 1);
+	int res = at_path(path, p, &d, &name);
+	if (res == 0) res = readlinkat(d.fd, name, buf, size - 1);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -368,9 +654,23 @@ static int userModeFS_readlink(const char *path, char *buf, size_t size) {
 static int userModeFS_release(const char *path, struct fuse_file_info *fi) {
 	DBG("release\n");
 
-	if (stats_enabled && strcmp(path, STATS_FILENAME) == 0) return 0;
+	struct vfile *v = vfile_of(fi->fh);
+	if (v) {
+		if (v->kind == VFILE_CONTROL && v->data) ctl_release(v->data);
+		if (v->kind == VFILE_HEAT) free(v->data);
+		free(v);
+		return 0;
+	}
 	if(monitor)mprintf("release(close): %s",path);
-	int res = close(fi->fh);
+	if (pack_is_fh(fi->fh)) {
+		int res = pack_release(fi->fh);
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	if (tier_root && (fi->flags & 3) != O_RDONLY) tier_writer(fi->fh, 0);
+	if (tier_root && (fi->flags & 3) == O_RDONLY) tier_release(fi->fh);
+	if (compress_enabled) compress_release(path, fi->fh, fi->flags);
+	int res = fdcache_release(fi->fh);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -384,20 +684,57 @@ static int userModeFS_rename(const char *from, const char *to) {
 	DBG("rename\n");
 
 	char f[PATHLEN_MAX];
-	snprintf(f, PATHLEN_MAX, "%s%s", root, from);
-
 	char t[PATHLEN_MAX];
-	snprintf(t, PATHLEN_MAX, "%s%s", root, to);
+	struct dirref df, dt;
+	const char *fname, *tname;
 	if(monitor)mprintf("rename from:%s, to:%s",from,to);
-	int res = rename(f, t);
+	int res;
+	if (pack_threshold && (res = pack_rename(from, to)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	if (pack_threshold && strcmp(from, to) != 0 && (pack_has_children(to) || pack_exists(to))) {
+		/* the backing rename cannot see what is packed under or at to */
+		struct stat st;
+		snprintf(f, PATHLEN_MAX, "%s%s", root, from);
+		res = pack_has_children(to) ? ENOTEMPTY : lstat(f, &st) == -1 ? errno : S_ISDIR(st.st_mode) ? ENOTDIR : 0;
+		if (res) {
+			if(monitor)mprintf(" res=%x\n",res);
+			return -res;
+		}
+	}
+	struct stat st;
+	dt.ent = NULL;
+	res = at_path(from, f, &df, &fname);
+	if (res == 0) res = at_path(to, t, &dt, &tname);
+	if (res == 0 && compress_enabled && fstatat(dt.fd, tname, &st, AT_SYMLINK_NOFOLLOW) == -1) st.st_mode = 0;
+	if (res == 0) res = renameat(df.fd, fname, dt.fd, tname);
+	dircache_put(&df);
+	dircache_put(&dt);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
 		return -res;
 	}
+	if (pack_threshold) {
+		pack_unlink(to);
+		if ((res = pack_rename_tree(from, to))) {
+			/* the packed files inside could not follow, put the directory back */
+			snprintf(f, PATHLEN_MAX, "%s%s", root, from);
+			snprintf(t, PATHLEN_MAX, "%s%s", root, to);
+			if (rename(t, f) == -1) perror(t);
+			if(monitor)mprintf(" res=%x\n",-res);
+			return res;
+		}
+	}
 
 	// The path should no longer exist
-	
+	dircache_invalidate(from);
+	dircache_invalidate(to);
+	tier_invalidate(from, 1);
+	tier_invalidate(to, 1);
+	if (compress_enabled) compress_unlinked(&st);
+
 	if(monitor)mprintf(" res=OK\n");
 	return 0;
 }
@@ -406,9 +743,16 @@ static int userModeFS_rmdir(const char *path) {
 	DBG("rmdir\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("rmdir: %s",path);
-	int res = rmdir(p);
+	if (pack_threshold && pack_has_children(path)) {
+		if(monitor)mprintf(" res=%x\n",ENOTEMPTY);
+		return -ENOTEMPTY;
+	}
+	int res = at_path(path, p, &d, &name);
+	if (res == 0) res = unlinkat(d.fd, name, AT_REMOVEDIR);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -416,7 +760,9 @@ static int userModeFS_rmdir(const char *path) {
 	}
 
 	// The path should no longer exist
-	
+	dircache_invalidate(path);
+	tier_invalidate(path, 1);
+
 	if(monitor)mprintf(" res=OK\n");
 	return 0;
 }
@@ -444,9 +790,16 @@ static int userModeFS_symlink(const char *from, const char *to) {
 
 
 	char t[PATHLEN_MAX];
-	snprintf(t, PATHLEN_MAX, "%s%s", root, to);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("symlink from:%s, to:%s",from,to);
-	int res = symlink(from, t);
+	if (pack_threshold && pack_exists(to)) {
+		if(monitor)mprintf(" res=%x\n",EEXIST);
+		return -EEXIST;
+	}
+	int res = at_path(to, t, &d, &name);
+	if (res == 0) res = symlinkat(from, d.fd, name);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -459,10 +812,22 @@ static int userModeFS_symlink(const char *from, const char *to) {
 static int userModeFS_truncate(const char *path, off_t size) {
 	DBG("truncate\n");
 
+	if (ctl_enabled && strcmp(path, CONTROL_FILENAME) == 0) return ctl_allowed() ? 0 : -EACCES;
+
 	char p[PATHLEN_MAX];
 	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
 	if(monitor)mprintf("truncate: %s",path);
-	int res = truncate(p, size);
+	int res;
+	if (pack_threshold && (res = pack_truncate(path, size)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	if (compress_enabled && size && (res = compress_prepare(path, O_WRONLY)) != 0) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	tier_invalidate(path, 0);
+	res = truncate(p, size);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -476,16 +841,29 @@ static int userModeFS_unlink(const char *path) {
 	DBG("unlink\n");
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
 	if(monitor)mprintf("unlink: %s",path);
-	int res = unlink(p);
+	int res;
+	if (pack_threshold && (res = pack_unlink(path)) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	struct stat st;
+	res = at_path(path, p, &d, &name);
+	if (res == 0 && compress_enabled && fstatat(d.fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) st.st_mode = 0;
+	if (res == 0) res = unlinkat(d.fd, name, 0);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
 		return -res;
 	}
 
-	// The path should no longer exist
+	// The path should no longer exist, it may have been a symlink cached as a directory
+	dircache_invalidate(path);
+	tier_invalidate(path, 0);
+	if (compress_enabled) compress_unlinked(&st);
 
 	if(monitor)mprintf(" res=OK\n");
 	return 0;
@@ -495,11 +873,27 @@ static int userModeFS_utime(const char *path, struct utimbuf *buf) {
 	DBG("utime\n");
 
 	if (stats_enabled && strcmp(path, STATS_FILENAME) == 0) return 0;
+	if (ctl_enabled && strcmp(path, CONTROL_FILENAME) == 0) return 0;
+	if (heat_enabled && strcmp(path, HEATMAP_FILENAME) == 0) return 0;
 
 	char p[PATHLEN_MAX];
-	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	struct dirref d;
+	const char *name;
+	struct timespec ts[2];
 	if(monitor)mprintf("utime: %s",path);
-	int res = utime(p, buf);
+	if (buf) {
+		ts[0].tv_sec = buf->actime;
+		ts[1].tv_sec = buf->modtime;
+		ts[0].tv_nsec = ts[1].tv_nsec = 0;
+	}
+	int res;
+	if (pack_threshold && (res = pack_utime(path, buf ? buf->actime : time(NULL), buf ? buf->modtime : time(NULL))) != -ENOENT) {
+		if(monitor)mprintf(" res=%x\n",-res);
+		return res;
+	}
+	res = at_path(path, p, &d, &name);
+	if (res == 0) res = utimensat(d.fd, name, buf ? ts : NULL, 0);
+	dircache_put(&d);
 	if (res == -1) {
 		res=errno;
 		if(monitor)mprintf(" res=%x\n",res);
@@ -509,15 +903,52 @@ static int userModeFS_utime(const char *path, struct utimbuf *buf) {
 	return 0;
 }
 
+#if FUSE_VERSION >= 29
+/* preallocate or punch holes in the backing file instead of having zeros written */
+static int userModeFS_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	DBG("fallocate\n");
+
+	if (vfile_of(fi->fh)) return -EOPNOTSUPP;
+	if (pack_is_fh(fi->fh)) return -EOPNOTSUPP;
+
+	if(monitor)mprintf("fallocate: %s,mode=%x,offset=%llx,length=%llx",path,mode,(long long)offset,(long long)length);
+    #ifdef linux
+	int res = fallocate(fi->fh, mode, offset, length);
+	if (res == -1) res = errno;
+    #else
+	int res = mode ? EOPNOTSUPP : posix_fallocate(fi->fh, offset, length);
+    #endif
+	if (res) {
+		if(monitor)mprintf(" res=%x\n",res);
+		return -res;
+	}
+	if(monitor)mprintf(" res=OK\n");
+	return 0;
+}
+#endif
+
 static int userModeFS_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
 	(void)path;
 
 	DBG("write\n");
 
-	int res = pwrite(fi->fh, buf, size, offset);
-	if (res == -1) return -errno;
+	struct vfile *v = vfile_of(fi->fh);
+	if (v) return v->kind == VFILE_CONTROL && v->data ? ctl_write(v->data, buf, size) : -EBADF;
+
+	qos_admit(size);
+
+	int res;
+	if (pack_is_fh(fi->fh)) {
+		res = pack_write(fi->fh, buf, size, offset);
+		if (res < 0) return res;
+	}
+	else {
+		res = pwrite(fi->fh, buf, size, offset);
+		if (res == -1) return -errno;
+	}
 
 	if (stats_enabled) stats_add_written(size);
+	if (heat_enabled) heat_note(path, offset, res, 1);
 
 	return res;
 }
@@ -528,6 +959,7 @@ static int userModeFS_getxattr(const char *path, const char *name, char *value,
 
 	char p[PATHLEN_MAX];
 	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	if (pack_threshold && pack_exists(path)) return -ENODATA;
 	if(monitor)mprintf("getxattr: %s",path);
 	int res = lgetxattr(p, name, value, size);
 	if (res == -1) {
@@ -544,6 +976,7 @@ static int userModeFS_listxattr(const char *path, char *list, size_t size) {
 
 	char p[PATHLEN_MAX];
 	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	if (pack_threshold && pack_exists(path)) return 0;
 	if(monitor)mprintf("listxattr: %s",path);
 	int res = llistxattr(p, list, size);
 	if (res == -1) {
@@ -560,6 +993,7 @@ static int userModeFS_removexattr(const char *path, const char *name) {
 
 	char p[PATHLEN_MAX];
 	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	if (pack_threshold && pack_exists(path)) return -ENOTSUP;
 	if(monitor)mprintf("removexattr: %s,name=%s",path,name);
 	int res = lremovexattr(p, name);
 	if (res == -1) {
@@ -576,6 +1010,7 @@ static int userModeFS_setxattr(const char *path, const char *name, const char *v
 
 	char p[PATHLEN_MAX];
 	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	if (pack_threshold && pack_exists(path)) return -ENOTSUP;
 	if(monitor)mprintf("setxattr: %s,name=%s,value=%s",path,name,value);
 	int res = lsetxattr(p, name, value, size, flags);
 	if (res == -1) {
@@ -588,38 +1023,251 @@ static int userModeFS_setxattr(const char *path, const char *name, const char *v
 }
 #endif /* HAVE_SETXATTR */
 
+/* called once the filesystem is mounted, settles the capabilities of the connection with the kernel */
+static void *userModeFS_init(struct fuse_conn_info *conn) {
+	DBG("init\n");
+
+	conn_negotiate(conn);
+	if (watch_enabled) watch_start();
+	if(monitor)mprintf("init: protocol %u.%u, want=%x, max_write=%u, max_readahead=%u\n",
+		conn->proto_major,conn->proto_minor,conn->want,conn->max_write,conn->max_readahead);
+	return NULL;
+}
+
+/* the traced_ wrappers put the static probes and CPU accounting around each callback */
+static int traced_access(const char *path, int mask) {
+	TRACE_BEGIN(access, path, 0, 0);
+	int res = userModeFS_access(path, mask);
+	TRACE_END(access, path, 0, 0, res);
+	return res;
+}
+
+static int traced_chmod(const char *path, mode_t mode) {
+	TRACE_BEGIN(chmod, path, 0, 0);
+	int res = userModeFS_chmod(path, mode);
+	TRACE_END(chmod, path, 0, 0, res);
+	return res;
+}
+
+static int traced_chown(const char *path, uid_t uid, gid_t gid) {
+	TRACE_BEGIN(chown, path, 0, 0);
+	int res = userModeFS_chown(path, uid, gid);
+	TRACE_END(chown, path, 0, 0, res);
+	return res;
+}
+
+static int traced_flush(const char *path, struct fuse_file_info *fi) {
+	TRACE_BEGIN(flush, path, 0, 0);
+	int res = userModeFS_flush(path, fi);
+	TRACE_END(flush, path, 0, 0, res);
+	return res;
+}
+
+static int traced_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+	TRACE_BEGIN(fsync, path, 0, 0);
+	int res = userModeFS_fsync(path, isdatasync, fi);
+	TRACE_END(fsync, path, 0, 0, res);
+	return res;
+}
+
+static int traced_getattr(const char *path, struct stat *stbuf) {
+	TRACE_BEGIN(getattr, path, 0, 0);
+	int res = userModeFS_getattr(path, stbuf);
+	TRACE_END(getattr, path, 0, 0, res);
+	return res;
+}
+
+static int traced_link(const char *from, const char *to) {
+	TRACE_BEGIN(link, from, 0, 0);
+	int res = userModeFS_link(from, to);
+	TRACE_END(link, from, 0, 0, res);
+	return res;
+}
+
+static int traced_mkdir(const char *path, mode_t mode) {
+	TRACE_BEGIN(mkdir, path, 0, 0);
+	int res = userModeFS_mkdir(path, mode);
+	TRACE_END(mkdir, path, 0, 0, res);
+	return res;
+}
+
+static int traced_mknod(const char *path, mode_t mode, dev_t rdev) {
+	TRACE_BEGIN(mknod, path, 0, 0);
+	int res = userModeFS_mknod(path, mode, rdev);
+	TRACE_END(mknod, path, 0, 0, res);
+	return res;
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi) {
+	TRACE_BEGIN(open, path, 0, 0);
+	int res = userModeFS_open(path, fi);
+	TRACE_END(open, path, 0, 0, res);
+	return res;
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACE_BEGIN(read, path, size, offset);
+	int res = userModeFS_read(path, buf, size, offset, fi);
+	TRACE_END(read, path, size, offset, res);
+	return res;
+}
+
+static int traced_readlink(const char *path, char *buf, size_t size) {
+	TRACE_BEGIN(readlink, path, size, 0);
+	int res = userModeFS_readlink(path, buf, size);
+	TRACE_END(readlink, path, size, 0, res);
+	return res;
+}
+
+/* the readdir method is chosen per call so that it can be changed through the control file */
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	TRACE_BEGIN(readdir, path, 0, offset);
+	int res = readdir_method2 ? userModeFS_readdirMethod2(path, buf, filler, offset, fi)
+	                          : userModeFS_readdirMethod1(path, buf, filler, offset, fi);
+	TRACE_END(readdir, path, 0, offset, res);
+	return res;
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi) {
+	TRACE_BEGIN(release, path, 0, 0);
+	int res = userModeFS_release(path, fi);
+	TRACE_END(release, path, 0, 0, res);
+	return res;
+}
+
+static int traced_rename(const char *from, const char *to) {
+	TRACE_BEGIN(rename, from, 0, 0);
+	int res = userModeFS_rename(from, to);
+	TRACE_END(rename, from, 0, 0, res);
+	return res;
+}
+
+static int traced_rmdir(const char *path) {
+	TRACE_BEGIN(rmdir, path, 0, 0);
+	int res = userModeFS_rmdir(path);
+	TRACE_END(rmdir, path, 0, 0, res);
+	return res;
+}
+
+static int traced_statfs(const char *path, struct statvfs *stbuf) {
+	TRACE_BEGIN(statfs, path, 0, 0);
+	int res = userModeFS_statfs(path, stbuf);
+	TRACE_END(statfs, path, 0, 0, res);
+	return res;
+}
+
+static int traced_symlink(const char *from, const char *to) {
+	TRACE_BEGIN(symlink, to, 0, 0);
+	int res = userModeFS_symlink(from, to);
+	TRACE_END(symlink, to, 0, 0, res);
+	return res;
+}
+
+static int traced_truncate(const char *path, off_t size) {
+	TRACE_BEGIN(truncate, path, size, 0);
+	int res = userModeFS_truncate(path, size);
+	TRACE_END(truncate, path, size, 0, res);
+	return res;
+}
+
+static int traced_unlink(const char *path) {
+	TRACE_BEGIN(unlink, path, 0, 0);
+	int res = userModeFS_unlink(path);
+	TRACE_END(unlink, path, 0, 0, res);
+	return res;
+}
+
+static int traced_utime(const char *path, struct utimbuf *buf) {
+	TRACE_BEGIN(utime, path, 0, 0);
+	int res = userModeFS_utime(path, buf);
+	TRACE_END(utime, path, 0, 0, res);
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+static int traced_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	TRACE_BEGIN(fallocate, path, length, offset);
+	int res = userModeFS_fallocate(path, mode, offset, length, fi);
+	TRACE_END(fallocate, path, length, offset, res);
+	return res;
+}
+#endif
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TRACE_BEGIN(write, path, size, offset);
+	int res = userModeFS_write(path, buf, size, offset, fi);
+	TRACE_END(write, path, size, offset, res);
+	return res;
+}
+
+#ifdef HAVE_SETXATTR
+static int traced_getxattr(const char *path, const char *name, char *value, size_t size) {
+	TRACE_BEGIN(getxattr, path, size, 0);
+	int res = userModeFS_getxattr(path, name, value, size);
+	TRACE_END(getxattr, path, size, 0, res);
+	return res;
+}
+
+static int traced_listxattr(const char *path, char *list, size_t size) {
+	TRACE_BEGIN(listxattr, path, size, 0);
+	int res = userModeFS_listxattr(path, list, size);
+	TRACE_END(listxattr, path, size, 0, res);
+	return res;
+}
+
+static int traced_removexattr(const char *path, const char *name) {
+	TRACE_BEGIN(removexattr, path, 0, 0);
+	int res = userModeFS_removexattr(path, name);
+	TRACE_END(removexattr, path, 0, 0, res);
+	return res;
+}
+
+static int traced_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+	TRACE_BEGIN(setxattr, path, size, 0);
+	int res = userModeFS_setxattr(path, name, value, size, flags);
+	TRACE_END(setxattr, path, size, 0, res);
+	return res;
+}
+#endif /* HAVE_SETXATTR */
+
 static struct fuse_operations userModeFS_oper = {
-	.access	= userModeFS_access,
-	.chmod	= userModeFS_chmod,
-	.chown	= userModeFS_chown,
-	.flush	= userModeFS_flush,
-	.fsync	= userModeFS_fsync,
-	.getattr	= userModeFS_getattr,
-	.link	= userModeFS_link,
-	.mkdir	= userModeFS_mkdir,
-	.mknod	= userModeFS_mknod,
-	.open	= userModeFS_open,
-	.read	= userModeFS_read,
-	.readlink	= userModeFS_readlink,
-	.readdir	= userModeFS_readdirMethod1,
-	.release	= userModeFS_release,
-	.rename	= userModeFS_rename,
-	.rmdir	= userModeFS_rmdir,
-	.statfs	= userModeFS_statfs,
-	.symlink	= userModeFS_symlink,
-	.truncate	= userModeFS_truncate,
-	.unlink	= userModeFS_unlink,
-	.utime	= userModeFS_utime,
-	.write	= userModeFS_write,
+	.access	= traced_access,
+	.chmod	= traced_chmod,
+	.chown	= traced_chown,
+	.flush	= traced_flush,
+	.fsync	= traced_fsync,
+	.getattr	= traced_getattr,
+	.init	= userModeFS_init,
+	.link	= traced_link,
+	.mkdir	= traced_mkdir,
+	.mknod	= traced_mknod,
+	.open	= traced_open,
+	.read	= traced_read,
+	.readlink	= traced_readlink,
+	.readdir	= traced_readdir,
+	.release	= traced_release,
+	.rename	= traced_rename,
+	.rmdir	= traced_rmdir,
+	.statfs	= traced_statfs,
+	.symlink	= traced_symlink,
+	.truncate	= traced_truncate,
+	.unlink	= traced_unlink,
+	.utime	= traced_utime,
+	.write	= traced_write,
+#if FUSE_VERSION >= 29
+	.fallocate	= traced_fallocate,
+#endif
 #ifdef HAVE_SETXATTR
-	.getxattr	= userModeFS_getxattr,
-	.listxattr	= userModeFS_listxattr,
-	.removexattr	= userModeFS_removexattr,
-	.setxattr	= userModeFS_setxattr,
+	.getxattr	= traced_getxattr,
+	.listxattr	= traced_listxattr,
+	.removexattr	= traced_removexattr,
+	.setxattr	= traced_setxattr,
 #endif
 };
 int userFSMain(struct fuse_args *args,int use_readir_method2){
-	if(use_readir_method2)userModeFS_oper.readdir	= userModeFS_readdirMethod2;
+	readdir_method2=use_readir_method2;
+	if (pack_threshold && pack_load() == -1) return 1;
+	if (compress_enabled && compress_load() == -1) return 1;
 	umask(0);
 	return(fuse_main(args->argc, args->argv, &userModeFS_oper/*, NULL*/));
 }
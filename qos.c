@@ -0,0 +1,180 @@
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 25
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fuse.h>
+
+#include "qos.h"
+/*
+Per requester I/O capping. Every data request (read or write) is charged to the
+class of the uid, gid or pid in the FUSE context, one class per id, kept in a
+hash table. Each class owns two token buckets, one for requests per second and
+one for bytes per second, that refill continuously and may hold at most one
+second worth of tokens. A request takes its tokens straight away and, if that
+leaves the bucket in debt, the calling thread sleeps until the debt would have
+been repaid. A class idle for longer than a second has full buckets again, the
+same as a new one, so such classes are evicted once there are more than
+QOS_MAX_CLASSES.
+
+This only caps each class, it does not prioritise: a throttled class delays
+only its own requests and nothing is moved ahead of them. Metadata operations
+are never charged and requests of qos_small bytes or less are only charged
+against the request bucket.
+*/
+
+char qos_enabled;
+char qos_key;
+unsigned long qos_bw, qos_iops, qos_small;
+
+struct qos_class {
+	char key;                   /* qos_key when the class was made */
+	unsigned long id;
+	double bytes, ops;          /* available tokens, negative when in debt */
+	struct timespec last;       /* time of last refill */
+	struct qos_class *next;
+};
+
+static pthread_mutex_t qos_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct qos_class *qos_classes[QOS_BUCKETS];
+static unsigned long qos_count;
+static unsigned long qos_throttled, qos_throttled_ms;
+
+
+void qos_init() {
+	qos_enabled = 0;
+	qos_key = 'u';
+	qos_bw = qos_iops = 0;
+	qos_small = 65536;
+	qos_throttled = qos_throttled_ms = 0;
+	qos_count = 0;
+	memset(qos_classes, 0, sizeof(qos_classes));
+}
+
+int qos_set_key(const char *name) {/*
+select what requests are classified by, returns non zero if the name is not known
+*/
+	if (strcmp(name, "uid") == 0) qos_key = 'u';
+	else if (strcmp(name, "gid") == 0) qos_key = 'g';
+	else if (strcmp(name, "pid") == 0) qos_key = 'p';
+	else return 1;
+	return 0;
+}
+
+static unsigned long qos_requester() {
+	struct fuse_context *ctx = fuse_get_context();
+
+	if (!ctx) return 0;
+	switch (qos_key) {
+		case 'g': return ctx->gid;
+		case 'p': return ctx->pid;
+		default:  return ctx->uid;
+	}
+}
+
+static double qos_refill(double tokens, unsigned long rate, double elapsed) {
+	tokens += elapsed * rate;
+	if (tokens > rate) tokens = rate;   /* burst of at most one second */
+	return tokens;
+}
+
+static double qos_elapsed(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void qos_evict(const struct timespec *now) {/*
+drop the classes that have been idle for more than a second, called with the lock held
+*/
+	struct qos_class **pc, *c;
+	int i;
+
+	for (i = 0; i < QOS_BUCKETS; i++) {
+		for (pc = &qos_classes[i]; (c = *pc); ) {
+			if (qos_elapsed(&c->last, now) > 1) {
+				*pc = c->next;
+				free(c);
+				qos_count--;
+			}
+			else pc = &c->next;
+		}
+	}
+}
+
+static struct qos_class *qos_class(const struct timespec *now) {/*
+the class of the caller, made if it has none, NULL when out of memory. called with the lock held
+*/
+	unsigned long id = qos_requester();
+	unsigned int h = (unsigned int)((id * 2654435761u) ^ qos_key) % QOS_BUCKETS;
+	struct qos_class *c;
+
+	for (c = qos_classes[h]; c && (c->id != id || c->key != qos_key); c = c->next);
+	if (c) return c;
+	if (qos_count >= QOS_MAX_CLASSES) qos_evict(now);
+	if (!(c = calloc(1, sizeof(struct qos_class)))) return NULL;
+	c->key = qos_key;
+	c->id = id;
+	c->next = qos_classes[h];
+	qos_classes[h] = c;
+	qos_count++;
+	return c;
+}
+
+void qos_admit(size_t size) {
+	if (!qos_enabled) return;
+
+	struct qos_class *c;
+	struct timespec now;
+	double wait = 0, elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&qos_lock);
+	if (!(c = qos_class(&now))) {
+		pthread_mutex_unlock(&qos_lock);
+		return;
+	}
+	if (c->last.tv_sec == 0 && c->last.tv_nsec == 0) {
+		/* first request of this class starts with full buckets */
+		c->bytes = qos_bw;
+		c->ops = qos_iops;
+	}
+	else {
+		elapsed = qos_elapsed(&c->last, &now);
+		if (qos_bw) c->bytes = qos_refill(c->bytes, qos_bw, elapsed);
+		if (qos_iops) c->ops = qos_refill(c->ops, qos_iops, elapsed);
+	}
+	c->last = now;
+
+	if (qos_iops) {
+		c->ops -= 1;
+		if (c->ops < 0) wait = -c->ops / qos_iops;
+	}
+	if (qos_bw && size > qos_small) {
+		c->bytes -= size;
+		if (c->bytes < 0 && -c->bytes / qos_bw > wait) wait = -c->bytes / qos_bw;
+	}
+	pthread_mutex_unlock(&qos_lock);
+
+	if (wait > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		__sync_fetch_and_add(&qos_throttled, 1);
+		__sync_fetch_and_add(&qos_throttled_ms, (unsigned long)(wait * 1000));
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+	}
+}
+
+void qos_sprint(char *s) {
+	if (!qos_enabled) return;
+
+	sprintf(s, "QoS limits per %s: %lu bytes/s, %lu requests/s, small I/O <= %lu bytes\n",
+		qos_key == 'g' ? "gid" : qos_key == 'p' ? "pid" : "uid", qos_bw, qos_iops, qos_small);
+	sprintf(s+strlen(s), "QoS classes: %lu, throttled requests: %lu, total delay %lu ms\n", qos_count, qos_throttled, qos_throttled_ms);
+}
@@ -0,0 +1,21 @@
+#ifndef QOS_H
+#define QOS_H
+
+
+#define QOS_BUCKETS 1024        /* hash table of classes, one per id */
+#define QOS_MAX_CLASSES 4096    /* above this idle classes are evicted */
+
+
+extern char qos_enabled;
+extern char qos_key;                 /* 'u' uid, 'g' gid or 'p' pid */
+extern unsigned long qos_bw;         /* bytes per second per class, 0 = unlimited */
+extern unsigned long qos_iops;       /* data requests per second per class, 0 = unlimited */
+extern unsigned long qos_small;      /* requests up to this size bypass the bandwidth bucket */
+
+void qos_init();
+int qos_set_key(const char *name);
+void qos_admit(size_t size);
+void qos_sprint(char *s);
+
+
+#endif
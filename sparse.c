@@ -0,0 +1,81 @@
+#define _GNU_SOURCE        /* for SEEK_DATA and SEEK_HOLE */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sparse.h"
+/*
+Hole aware reads. The backing file is asked where its data is with
+lseek(SEEK_DATA/SEEK_HOLE) and holes are filled with zeros in the buffer
+instead of being read, so only the data extents of a sparse file are fetched
+from the backing filesystem. Descriptors are only ever used with pread/pwrite
+so moving their offset with lseek does no harm.
+*/
+
+char sparse_enabled;
+
+static unsigned long sparse_hole_bytes, sparse_data_bytes;
+
+
+void sparse_init() {
+	sparse_enabled = 0;
+	sparse_hole_bytes = sparse_data_bytes = 0;
+}
+
+ssize_t sparse_pread(int fd, char *buf, size_t size, off_t offset) {/*
+behaves as pread(fd, buf, size, offset)
+*/
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	size_t done = 0;
+
+	while (done < size) {
+		off_t pos = offset + done;
+		off_t data = lseek(fd, pos, SEEK_DATA);
+
+		if (data == -1) {
+			struct stat st;
+			if (errno != ENXIO || fstat(fd, &st) == -1) break;   /* not supported here, read normally */
+			/* nothing but hole up to the end of the file */
+			if (pos >= st.st_size) return done;
+			size_t n = size - done;
+			if ((off_t)n > st.st_size - pos) n = st.st_size - pos;
+			memset(buf + done, 0, n);
+			__sync_fetch_and_add(&sparse_hole_bytes, n);
+			return done + n;
+		}
+		if (data > pos) {
+			size_t n = size - done;
+			if ((off_t)n > data - pos) n = data - pos;
+			memset(buf + done, 0, n);
+			__sync_fetch_and_add(&sparse_hole_bytes, n);
+			done += n;
+			continue;
+		}
+
+		off_t hole = lseek(fd, pos, SEEK_HOLE);
+		size_t n = size - done;
+		if (hole > pos && (off_t)n > hole - pos) n = hole - pos;
+		ssize_t res = pread(fd, buf + done, n, pos);
+		if (res == -1) return done ? (ssize_t)done : -1;
+		__sync_fetch_and_add(&sparse_data_bytes, res);
+		done += res;
+		if ((size_t)res < n) return done;   /* end of file */
+	}
+	if (done == size) return done;
+
+	ssize_t res = pread(fd, buf + done, size - done, offset + done);
+	if (res == -1) return done ? (ssize_t)done : -1;
+	return done + res;
+#else
+	return pread(fd, buf, size, offset);
+#endif
+}
+
+void sparse_sprint(char *s) {
+	if (!sparse_enabled) return;
+
+	sprintf(s, "Sparse reads: %lu bytes of data read, %lu bytes of holes zero filled\n", sparse_data_bytes, sparse_hole_bytes);
+}
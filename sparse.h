@@ -0,0 +1,14 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <sys/types.h>
+
+
+extern char sparse_enabled;    /* look for holes before reading */
+
+void sparse_init();
+ssize_t sparse_pread(int fd, char *buf, size_t size, off_t offset);
+void sparse_sprint(char *s);
+
+
+#endif
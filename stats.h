@@ -3,7 +3,7 @@
 
 
 #define STATS_FILENAME "/stats"
-#define STATS_SIZE 2048
+#define STATS_SIZE 8192
 
 
 extern char stats_enabled;
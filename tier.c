@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "userModeFS.h"
+#include "tier.h"
+#include "compress.h"
+/*
+Hot/cold tiering. root (the capacity tier) always holds every file and stays
+authoritative, tier_root (the fast tier, e.g. local flash) holds copies of the
+files that are read most, under the same relative paths.
+
+Read only opens are counted per file. A background thread wakes every
+tier_interval seconds, halves all counts, copies files whose count reached
+tier_promote to the fast tier and, while the fast tier holds more than
+tier_budget bytes, drops the copies with the lowest counts. A read only open
+of a file with a fast copy is given the copy, provided the capacity file still
+has the inode, size, mtime and ctime (to the nanosecond) it had when it was
+copied, so changes made directly in root are never hidden. Opening for write,
+truncating, unlinking or renaming through passfs drops the copy. Files that are
+open for writing through passfs (by any name, tracked by inode) are neither
+promoted nor served from a fast copy, as a descriptor opened before the copy
+was made could still change them. Compressed files are not copied, the fast
+tier would not know to inflate them.
+
+A handle on a fast copy also holds a read only descriptor on the capacity file,
+opened (and checked) in its place. Dropping a copy only unlinks it, so when the
+capacity file is opened for writing or its copy is dropped every handle on the
+copy is marked stale and reads through it (tier_fd) go to the capacity file
+from then on, so a write is seen by readers that opened the copy before it.
+*/
+
+enum { TIER_SLOW, TIER_PROMOTING, TIER_FAST };
+
+struct tier_ent {
+	char *path;
+	unsigned long reads;
+	char state;
+	char cancel;                /* invalidated while being promoted */
+	off_t size;                 /* of the fast copy */
+	ino_t ino;                  /* capacity file when it was copied */
+	struct timespec mtime, ctime;
+	struct tier_ent *next;
+};
+
+/* a handle on a fast copy, by descriptor */
+struct tier_reader {
+	int fd;                     /* on the fast copy */
+	int capacity;               /* on the capacity file */
+	dev_t dev;                  /* of the capacity file */
+	ino_t ino;
+	char stale;                 /* read from capacity */
+	struct tier_reader *next;
+};
+
+/* capacity inodes open for writing */
+struct tier_writer {
+	dev_t dev;
+	ino_t ino;
+	unsigned int opens;
+	struct tier_writer *next;
+};
+
+char *tier_root;
+unsigned long tier_budget, tier_promote, tier_interval;
+
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tier_once = PTHREAD_ONCE_INIT;
+static struct tier_ent *tier_table[TIER_BUCKETS];
+static struct tier_writer *tier_writers[TIER_BUCKETS];
+static struct tier_reader *tier_readers[TIER_BUCKETS];
+static unsigned long tier_files, tier_used;
+static unsigned long tier_hits, tier_promotions, tier_demotions;
+
+
+void tier_init() {
+	tier_root = NULL;
+	tier_budget = 1UL << 30;
+	tier_promote = 4;
+	tier_interval = 5;
+	tier_files = tier_used = 0;
+	tier_hits = tier_promotions = tier_demotions = 0;
+	memset(tier_table, 0, sizeof(tier_table));
+	memset(tier_writers, 0, sizeof(tier_writers));
+	memset(tier_readers, 0, sizeof(tier_readers));
+}
+
+static unsigned int tier_hash(const char *s) {
+	unsigned int h = 2166136261u;
+	while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h % TIER_BUCKETS;
+}
+
+static struct tier_ent *tier_find(const char *path) {
+	struct tier_ent *e = tier_table[tier_hash(path)];
+	while (e && strcmp(e->path, path) != 0) e = e->next;
+	return e;
+}
+
+static struct tier_writer **tier_writer_find(dev_t dev, ino_t ino) {/*
+the link to the writer entry for the inode, *result is NULL if there is none, called with the lock held
+*/
+	struct tier_writer **pw = &tier_writers[(unsigned int)(ino ^ dev) % TIER_BUCKETS];
+	while (*pw && ((*pw)->dev != dev || (*pw)->ino != ino)) pw = &(*pw)->next;
+	return pw;
+}
+
+static int tier_written(const struct stat *st) {
+	pthread_mutex_lock(&tier_lock);
+	int res = *tier_writer_find(st->st_dev, st->st_ino) != NULL;
+	pthread_mutex_unlock(&tier_lock);
+	return res;
+}
+
+static int tier_same(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static void tier_stale(dev_t dev, ino_t ino, int any_dev) {/*
+send reads through the handles on fast copies of the capacity inode to the capacity file, called with the lock held
+*/
+	struct tier_reader *r;
+	int i;
+
+	for (i = 0; i < TIER_BUCKETS; i++) {
+		for (r = tier_readers[i]; r; r = r->next) {
+			if (r->ino == ino && (any_dev || r->dev == dev)) r->stale = 1;
+		}
+	}
+}
+
+static void tier_drop(struct tier_ent *e) {/*
+remove the fast copy of e, called with the lock held
+*/
+	char f[PATHLEN_MAX];
+
+	if (e->state == TIER_PROMOTING) {
+		e->cancel = 1;
+		return;
+	}
+	if (e->state == TIER_FAST) {
+		tier_stale(0, e->ino, 1);
+		snprintf(f, PATHLEN_MAX, "%s%s", tier_root, e->path);
+		unlink(f);
+		tier_used -= e->size;
+		tier_demotions++;
+	}
+	e->state = TIER_SLOW;
+	e->reads = 0;
+}
+
+static int tier_mkdirs(char *f) {/*
+make the directories leading to the fast path f
+*/
+	char *s = f + strlen(tier_root);
+
+	while ((s = strchr(s + 1, '/'))) {
+		*s = '\0';
+		int res = mkdir(f, 0755);
+		*s = '/';
+		if (res == -1 && errno != EEXIST) return -1;
+	}
+	return 0;
+}
+
+static int tier_copy(struct tier_ent *e, const char *path) {/*
+copy the capacity file to the fast tier, returns 0 on success
+*/
+	char p[PATHLEN_MAX], f[PATHLEN_MAX], t[PATHLEN_MAX + 16];
+	char buf[65536];
+	struct stat before, after;
+	ssize_t n;
+	int src, dst, res = -1;
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	snprintf(f, PATHLEN_MAX, "%s%s", tier_root, path);
+	snprintf(t, sizeof(t), "%s.passfs-tier", f);
+
+	src = open(p, O_RDONLY);
+	if (src == -1) return -1;
+	if (fstat(src, &before) == -1 || !S_ISREG(before.st_mode) || (unsigned long)before.st_size > tier_budget || tier_written(&before) ||
+	    compress_marked(&before)) {
+		close(src);
+		return -1;
+	}
+	tier_mkdirs(f);
+	dst = open(t, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (dst == -1) {
+		close(src);
+		return -1;
+	}
+	while ((n = read(src, buf, sizeof(buf))) > 0) {
+		if (write(dst, buf, n) != n) break;
+	}
+	if (n == 0 && fstat(src, &after) == 0 && tier_same(&after.st_mtim, &before.st_mtim) &&
+	    tier_same(&after.st_ctim, &before.st_ctim) && after.st_size == before.st_size) {
+		e->size = before.st_size;
+		e->ino = before.st_ino;
+		e->mtime = before.st_mtim;
+		e->ctime = before.st_ctim;
+		res = 0;
+	}
+	close(src);
+	if (close(dst) == -1) res = -1;
+	if (res == 0 && rename(t, f) == -1) res = -1;
+	if (res) unlink(t);
+	return res;
+}
+
+static void tier_pass() {/*
+one round of decay, promotion and demotion
+*/
+	struct tier_ent *e, **pp;
+	int i;
+
+	pthread_mutex_lock(&tier_lock);
+	for (i = 0; i < TIER_BUCKETS; i++) {
+		for (pp = &tier_table[i]; (e = *pp); ) {
+			if (e->state == TIER_SLOW && e->reads >= tier_promote) {
+				e->state = TIER_PROMOTING;
+				e->cancel = 0;
+				pthread_mutex_unlock(&tier_lock);
+				int res = tier_copy(e, e->path);
+				pthread_mutex_lock(&tier_lock);
+				/* the chain may have changed while the lock was dropped */
+				for (pp = &tier_table[i]; *pp != e; pp = &(*pp)->next);
+				e->state = TIER_SLOW;
+				if (res == 0) {
+					e->state = TIER_FAST;
+					tier_used += e->size;
+					tier_promotions++;
+					if (e->cancel) tier_drop(e);
+				}
+			}
+			e->reads /= 2;
+			if (e->state == TIER_SLOW && e->reads == 0) {
+				/* forget files nobody reads */
+				*pp = e->next;
+				free(e->path);
+				free(e);
+				tier_files--;
+				continue;
+			}
+			pp = &e->next;
+		}
+	}
+
+	while (tier_used > tier_budget) {
+		struct tier_ent *coldest = NULL;
+		for (i = 0; i < TIER_BUCKETS; i++) {
+			for (e = tier_table[i]; e; e = e->next) {
+				if (e->state == TIER_FAST && (!coldest || e->reads < coldest->reads)) coldest = e;
+			}
+		}
+		if (!coldest) break;
+		tier_drop(coldest);
+	}
+	pthread_mutex_unlock(&tier_lock);
+}
+
+static void *tier_thread(void *arg) {
+	(void)arg;
+	for (;;) {
+		sleep(tier_interval ? tier_interval : 1);
+		tier_pass();
+	}
+	return NULL;
+}
+
+static void tier_start() {
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, tier_thread, NULL) == 0) pthread_detach(tid);
+}
+
+int tier_open(const char *path, int flags) {/*
+count a read only open of path and return a descriptor on its fast copy if there
+is a valid one, otherwise -1 and the caller opens the capacity file
+*/
+	struct tier_ent *e;
+	struct tier_reader *r;
+	char p[PATHLEN_MAX];
+	struct stat st;
+	int fd = -1, capacity;
+
+	if ((flags & 3) != O_RDONLY || (flags & O_TRUNC)) {
+		tier_invalidate(path, 0);
+		return -1;
+	}
+	/* the background thread is started here as fuse_main forks when it daemonizes */
+	pthread_once(&tier_once, tier_start);
+
+	pthread_mutex_lock(&tier_lock);
+	e = tier_find(path);
+	if (!e && tier_files < TIER_MAX_FILES) {
+		e = calloc(1, sizeof(struct tier_ent));
+		if (e && !(e->path = strdup(path))) {
+			free(e);
+			e = NULL;
+		}
+		if (e) {
+			unsigned int h = tier_hash(path);
+			e->next = tier_table[h];
+			tier_table[h] = e;
+			tier_files++;
+		}
+	}
+	if (!e) {
+		pthread_mutex_unlock(&tier_lock);
+		return -1;
+	}
+	e->reads++;
+	if (e->state != TIER_FAST) {
+		pthread_mutex_unlock(&tier_lock);
+		return -1;
+	}
+	ino_t ino = e->ino;
+	struct timespec mtime = e->mtime, ctime = e->ctime;
+	off_t size = e->size;
+	pthread_mutex_unlock(&tier_lock);
+
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	capacity = open(p, O_RDONLY | O_NOFOLLOW);
+	if (capacity == -1) return -1;
+	if (fstat(capacity, &st) == -1 || st.st_ino != ino || !tier_same(&st.st_mtim, &mtime) || !tier_same(&st.st_ctim, &ctime) ||
+	    st.st_size != size || tier_written(&st)) {
+		/* changed behind our back */
+		close(capacity);
+		pthread_mutex_lock(&tier_lock);
+		if ((e = tier_find(path))) tier_drop(e);
+		pthread_mutex_unlock(&tier_lock);
+		return -1;
+	}
+	snprintf(p, PATHLEN_MAX, "%s%s", tier_root, path);
+	if (!(r = malloc(sizeof(struct tier_reader)))) return capacity;
+	fd = open(p, flags);
+	if (fd == -1) {
+		free(r);
+		return capacity;
+	}
+	r->fd = fd;
+	r->capacity = capacity;
+	r->dev = st.st_dev;
+	r->ino = st.st_ino;
+	r->stale = 0;
+	pthread_mutex_lock(&tier_lock);
+	r->next = tier_readers[fd % TIER_BUCKETS];
+	tier_readers[fd % TIER_BUCKETS] = r;
+	/* a writer that came in since the check above */
+	if (*tier_writer_find(st.st_dev, st.st_ino) || !(e = tier_find(path)) || e->state != TIER_FAST) r->stale = 1;
+	pthread_mutex_unlock(&tier_lock);
+	__sync_fetch_and_add(&tier_hits, 1);
+	return fd;
+}
+
+int tier_fd(int fd) {/*
+the descriptor to read through for fd, the capacity file once the fast copy fd is on went stale
+*/
+	struct tier_reader *r;
+
+	pthread_mutex_lock(&tier_lock);
+	for (r = tier_readers[fd % TIER_BUCKETS]; r && r->fd != fd; r = r->next);
+	if (r && r->stale) fd = r->capacity;
+	pthread_mutex_unlock(&tier_lock);
+	return fd;
+}
+
+void tier_release(int fd) {/*
+fd, possibly a descriptor from tier_open, is being released
+*/
+	struct tier_reader **pr, *r;
+
+	pthread_mutex_lock(&tier_lock);
+	for (pr = &tier_readers[fd % TIER_BUCKETS]; (r = *pr) && r->fd != fd; pr = &r->next);
+	if (r) *pr = r->next;
+	pthread_mutex_unlock(&tier_lock);
+	if (r) {
+		close(r->capacity);
+		free(r);
+	}
+}
+
+void tier_writer(int fd, int opened) {/*
+note that fd, a descriptor on a capacity file opened for writing, was opened (1) or is being released (0)
+*/
+	struct tier_writer **pw, *w;
+	struct stat st;
+
+	if (!tier_root || fstat(fd, &st) == -1) return;
+	pthread_mutex_lock(&tier_lock);
+	pw = tier_writer_find(st.st_dev, st.st_ino);
+	if (opened) {
+		if (!*pw && (*pw = calloc(1, sizeof(struct tier_writer)))) {
+			(*pw)->dev = st.st_dev;
+			(*pw)->ino = st.st_ino;
+		}
+		if (*pw) (*pw)->opens++;
+		tier_stale(st.st_dev, st.st_ino, 0);
+	}
+	else if ((w = *pw) && --w->opens == 0) {
+		*pw = w->next;
+		free(w);
+	}
+	pthread_mutex_unlock(&tier_lock);
+}
+
+void tier_invalidate(const char *path, int tree) {/*
+drop the fast copy of path and, if tree is set, of everything below it
+*/
+	size_t len = strlen(path);
+	struct tier_ent *e;
+	int i;
+
+	if (!tier_root) return;
+	if (len == 1) len = 0;   /* "/" */
+	pthread_mutex_lock(&tier_lock);
+	if ((e = tier_find(path))) tier_drop(e);
+	for (i = 0; tree && i < TIER_BUCKETS; i++) {
+		for (e = tier_table[i]; e; e = e->next) {
+			if (e->state != TIER_SLOW && strncmp(e->path, path, len) == 0 && e->path[len] == '/') tier_drop(e);
+		}
+	}
+	pthread_mutex_unlock(&tier_lock);
+}
+
+void tier_sprint(char *s) {
+	if (!tier_root) return;
+
+	sprintf(s, "Fast tier: %lu of %lu bytes used, %lu files tracked\n", tier_used, tier_budget, tier_files);
+	sprintf(s+strlen(s), "Fast tier opens/promotions/demotions: %lu/%lu/%lu\n", tier_hits, tier_promotions, tier_demotions);
+}
@@ -0,0 +1,23 @@
+#ifndef TIER_H
+#define TIER_H
+
+
+#define TIER_BUCKETS 4096
+#define TIER_MAX_FILES 65536     /* most files tracked at once */
+
+
+extern char *tier_root;                /* the fast root, NULL when tiering is off */
+extern unsigned long tier_budget;      /* bytes the fast root may hold */
+extern unsigned long tier_promote;     /* read opens (decayed) before a file is promoted */
+extern unsigned long tier_interval;    /* seconds between promotion/demotion passes */
+
+void tier_init();
+int tier_open(const char *path, int flags);
+int tier_fd(int fd);
+void tier_release(int fd);
+void tier_writer(int fd, int opened);
+void tier_invalidate(const char *path, int tree);
+void tier_sprint(char *s);
+
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+/*
+Per callback accounting of the CPU time used by the calling thread, measured
+with CLOCK_THREAD_CPUTIME_ID so time spent blocked in the backing filesystem
+is not counted. Counters are updated with atomic adds, no lock is taken.
+*/
+
+char trace_cputime;
+
+static const char *trace_names[TRACE_NOPS] = {
+#define X(name) #name,
+	TRACE_OPS
+#undef X
+};
+
+static unsigned long trace_calls[TRACE_NOPS];
+static unsigned long long trace_cpu_ns[TRACE_NOPS];
+
+
+void trace_init() {
+	trace_cputime = 0;
+	memset(trace_calls, 0, sizeof(trace_calls));
+	memset(trace_cpu_ns, 0, sizeof(trace_cpu_ns));
+}
+
+void trace_begin(struct timespec *start) {
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, start);
+}
+
+void trace_end(int op, const struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	__sync_fetch_and_add(&trace_calls[op], 1);
+	__sync_fetch_and_add(&trace_cpu_ns[op], (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec);
+}
+
+void trace_sprint(char *s) {
+	int i;
+
+	if (!trace_cputime) return;
+
+	sprintf(s, "CPU time per callback (calls, total us, ns/call):\n");
+	for (i = 0; i < TRACE_NOPS; i++) {
+		if (!trace_calls[i]) continue;
+		sprintf(s+strlen(s), "  %-12s %10lu %12llu %8llu\n", trace_names[i], trace_calls[i],
+			trace_cpu_ns[i] / 1000, trace_cpu_ns[i] / trace_calls[i]);
+	}
+}
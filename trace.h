@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+/*
+Static probes passfs:op_entry(op, path, size, offset) and
+passfs:op_return(op, path, size, offset, result) around every callback.
+They are only compiled in when <sys/sdt.h> is available (HAVE_SYS_SDT_H) and
+cost a nop each until a tracer such as bpftrace or perf attaches to them.
+*/
+#ifdef HAVE_SYS_SDT_H
+	#include <sys/sdt.h>
+	#define TRACE_PROBE_ENTRY(op, path, size, off) \
+		STAP_PROBE4(passfs, op_entry, op, path, (long long)(size), (long long)(off))
+	#define TRACE_PROBE_RETURN(op, path, size, off, res) \
+		STAP_PROBE5(passfs, op_return, op, path, (long long)(size), (long long)(off), (int)(res))
+#else
+	#define TRACE_PROBE_ENTRY(op, path, size, off)
+	#define TRACE_PROBE_RETURN(op, path, size, off, res)
+#endif
+
+/* the callbacks that are accounted for, X(name) for each */
+#define TRACE_OPS \
+	X(access) X(chmod) X(chown) X(flush) X(fsync) X(getattr) X(link) X(mkdir) \
+	X(mknod) X(open) X(read) X(readlink) X(readdir) X(release) X(rename) \
+	X(rmdir) X(statfs) X(symlink) X(truncate) X(unlink) X(utime) X(write) \
+	X(getxattr) X(listxattr) X(removexattr) X(setxattr) X(fallocate)
+
+enum {
+#define X(name) TRACE_##name,
+	TRACE_OPS
+#undef X
+	TRACE_NOPS
+};
+
+extern char trace_cputime;   /* account thread CPU time per callback */
+
+void trace_init();
+void trace_begin(struct timespec *start);
+void trace_end(int op, const struct timespec *start);
+void trace_sprint(char *s);
+
+/* bracket a callback, op is one of the names in TRACE_OPS. trace_cputime is read
+   once so that turning it on through the control file mid-call is harmless */
+#define TRACE_BEGIN(op, path, size, off) \
+	struct timespec trace_start; \
+	char trace_on = trace_cputime; \
+	TRACE_PROBE_ENTRY(#op, path, size, off); \
+	if (trace_on) trace_begin(&trace_start)
+
+#define TRACE_END(op, path, size, off, res) \
+	if (trace_on) trace_end(TRACE_##op, &trace_start); \
+	TRACE_PROBE_RETURN(#op, path, size, off, res)
+
+
+#endif
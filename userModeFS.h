@@ -4,7 +4,12 @@
 
 #define PATHLEN_MAX 1024
 
-char *root;
+struct fuse_args;
+
+extern char *root;
+extern int monitor;
+extern int readdir_method2;
 int monitorInit(const char *file);
+int monitorSet(int level);
 int userFSMain(struct fuse_args *args,int use_readir_method2);
 #endif
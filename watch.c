@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "userModeFS.h"
+#include "dircache.h"
+#include "tier.h"
+#include "pack.h"
+#include "watch.h"
+/*
+Backing root watcher. Changes made in root by other processes (or by other
+hosts on a shared filesystem that reports them) bypass passfs, so its caches
+would only notice them by revalidating. With the watcher on, a thread puts an
+inotify watch on every directory under root and, as events arrive, drops the
+cached directory descriptors and fast tier copies for the changed paths. New
+directories are watched as they appear. If the kernel's event queue overflows
+every cache is dropped, as there is no telling what was missed.
+
+The kernel's own attribute and entry caches cannot be invalidated through the
+FUSE 2 high level API, they still expire by entry_timeout and attr_timeout.
+*/
+
+struct watch_dir {
+	int wd;
+	char *path;
+	struct watch_dir *next;
+};
+
+char watch_enabled;
+unsigned long watch_max;
+
+/* only the watcher thread touches the table */
+static struct watch_dir *watch_table[WATCH_BUCKETS];
+static int watch_fd = -1;
+static unsigned long watch_dirs, watch_events, watch_overflows, watch_missed;
+
+
+void watch_init() {
+	watch_enabled = 0;
+	watch_max = 8192;
+	watch_fd = -1;
+	watch_dirs = watch_events = watch_overflows = watch_missed = 0;
+	memset(watch_table, 0, sizeof(watch_table));
+}
+
+#ifdef linux
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR)
+
+static struct watch_dir *watch_find(int wd) {
+	struct watch_dir *w = watch_table[wd % WATCH_BUCKETS];
+	while (w && w->wd != wd) w = w->next;
+	return w;
+}
+
+static void watch_forget(struct watch_dir *w) {
+	struct watch_dir **pp = &watch_table[w->wd % WATCH_BUCKETS];
+	while (*pp != w) pp = &(*pp)->next;
+	*pp = w->next;
+	free(w->path);
+	free(w);
+	watch_dirs--;
+}
+
+static void watch_forget_tree(const char *path) {/*
+stop watching path and the directories below it
+*/
+	size_t len = strlen(path);
+	struct watch_dir *w, *next;
+	int i;
+
+	for (i = 0; i < WATCH_BUCKETS; i++) {
+		for (w = watch_table[i]; w; w = next) {
+			next = w->next;
+			if (strncmp(w->path, path, len) == 0 && (w->path[len] == '\0' || w->path[len] == '/')) {
+				inotify_rm_watch(watch_fd, w->wd);
+				watch_forget(w);
+			}
+		}
+	}
+}
+
+static void watch_tree(const char *path) {/*
+watch path and the directories below it
+*/
+	char p[PATHLEN_MAX], child[PATHLEN_MAX];
+	struct watch_dir *w;
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+	int wd;
+
+	if (pack_reserved(path)) return;
+	if (watch_dirs >= watch_max) {
+		watch_missed++;
+		return;
+	}
+	snprintf(p, PATHLEN_MAX, "%s%s", root, path);
+	wd = inotify_add_watch(watch_fd, p, WATCH_MASK);
+	if (wd == -1) {
+		if (errno == ENOSPC) watch_missed++;
+		return;
+	}
+	if ((w = watch_find(wd))) {
+		/* the same directory seen again, e.g. after a rename */
+		char *s = strdup(path);
+		if (s) {
+			free(w->path);
+			w->path = s;
+		}
+	}
+	else if ((w = malloc(sizeof(struct watch_dir))) && (w->path = strdup(path))) {
+		w->wd = wd;
+		w->next = watch_table[wd % WATCH_BUCKETS];
+		watch_table[wd % WATCH_BUCKETS] = w;
+		watch_dirs++;
+	}
+	else {
+		free(w);
+		inotify_rm_watch(watch_fd, wd);
+		return;
+	}
+
+	if (!(dp = opendir(p))) return;
+	while ((de = readdir(dp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) continue;
+		snprintf(child, PATHLEN_MAX, "%s/%s", strcmp(path, "/") == 0 ? "" : path, de->d_name);
+		if (de->d_type == DT_UNKNOWN) {
+			snprintf(p, PATHLEN_MAX, "%s%s", root, child);
+			if (lstat(p, &st) == -1 || !S_ISDIR(st.st_mode)) continue;
+		}
+		watch_tree(child);
+	}
+	closedir(dp);
+}
+
+static void watch_event(const struct inotify_event *ev) {
+	char path[PATHLEN_MAX];
+	struct watch_dir *w;
+	int isdir = (ev->mask & IN_ISDIR) != 0;
+
+	watch_events++;
+	if (ev->mask & IN_Q_OVERFLOW) {
+		watch_overflows++;
+		dircache_invalidate("/");
+		tier_invalidate("/", 1);
+		return;
+	}
+	if (!(w = watch_find(ev->wd))) return;
+	if (ev->mask & IN_IGNORED) {
+		/* the directory is gone */
+		watch_forget(w);
+		return;
+	}
+	if (!ev->len) return;
+	snprintf(path, PATHLEN_MAX, "%s/%s", strcmp(w->path, "/") == 0 ? "" : w->path, ev->name);
+
+	tier_invalidate(path, isdir);
+	if (!isdir) return;
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) dircache_invalidate(path);
+	if (ev->mask & IN_MOVED_FROM) watch_forget_tree(path);
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO)) watch_tree(path);
+}
+
+static void *watch_thread(void *arg) {
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	char *ptr;
+
+	(void)arg;
+	watch_tree("/");
+	if (watch_missed) fprintf(stderr, "watch: %lu directories under %s are not watched, raise watch_max or fs.inotify.max_user_watches\n", watch_missed, root);
+	for (;;) {
+		n = read(watch_fd, buf, sizeof(buf));
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) break;
+		for (ptr = buf; ptr < buf + n; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+			watch_event((struct inotify_event *)ptr);
+		}
+	}
+	perror("watch");
+	return NULL;
+}
+
+void watch_start() {/*
+called once mounted, the walk of root is done by the thread so the mount is not held up
+*/
+	pthread_t tid;
+
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	if (watch_fd == -1) {
+		perror("watch");
+		return;
+	}
+	if (pthread_create(&tid, NULL, watch_thread, NULL) == 0) pthread_detach(tid);
+}
+
+#else
+
+void watch_start() {
+	fprintf(stderr, "watch: inotify is not available on this system\n");
+}
+
+#endif
+
+void watch_sprint(char *s) {
+	if (!watch_enabled) return;
+
+	sprintf(s, "Watcher: %lu directories watched (%lu missed), %lu events, %lu queue overflows\n", watch_dirs, watch_missed, watch_events, watch_overflows);
+}
@@ -0,0 +1,16 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+
+#define WATCH_BUCKETS 1024
+
+
+extern char watch_enabled;           /* follow changes made directly in root */
+extern unsigned long watch_max;      /* most directories watched */
+
+void watch_init();
+void watch_start();
+void watch_sprint(char *s);
+
+
+#endif